@@ -0,0 +1,103 @@
+#!/bin/sh
+# CheckDirs.sh -- run from this directory after make, or by make check.
+# For each directory format, fills the root directory of D2 with 95
+# long names, so that it grows past IndexMinBLOCKS and gets its index
+# (in the stream format, by indexMakeRoom() shifting every entry), and
+# past a full bucket, so that the index is rebuilt with more buckets.
+# Then removes names in shuffled order, adds new names of the same
+# lengths (which take the tombstones), removes until compact() runs,
+# and adds names again.  Every file left is copied back out and
+# compared, and ls must list exactly those names.  Usage:
+#   sh CheckDirs.sh [seed]
+
+seed=${1:-1}
+top=`pwd`
+work=${TMPDIR:-/tmp}/checkdirs.$$
+mkdir -p $work || exit 1
+trap 'rm -fr $work' 0
+cp diskParams.dat $work
+cd $work
+
+# names: one per line, 95 of them, 30 to 50 characters long
+awk -v seed=$seed 'BEGIN {
+  srand(seed);
+  for (i = 0; i < 95; i++) {
+    nm = sprintf("f%02d_", i);
+    n = 30 + int(rand() * 21);
+    while (length(nm) < n)
+      nm = nm substr("abcdefghijklmnopqrstuvwxyz0123456789", 1 + int(rand() * 36), 1);
+    print nm;
+  }
+}' > names
+
+# shuffle FILE SEED: the lines of FILE in an order from SEED
+shuffle() {
+  awk -v seed=$2 'BEGIN { srand(seed) } { print rand() "\t" $0 }' $1 |
+    sort -n | cut -f 2-
+}
+
+# drop FILE: take the names in FILE out of live
+drop() {
+  awk 'NR == FNR { gone[$0] = 1; next } !($1 in gone)' $1 live > live.new
+  mv live.new live
+}
+
+nFail=0
+for fmt in stream stride; do
+  # in.N holds N+1 lines, so that no two of them are alike
+  i=0
+  for nm in `cat names`; do
+    awk -v n=$i 'BEGIN { for (k = 0; k <= n; k++) print "line", k, "of", n }' > in.$i
+    echo "$nm $i"
+    i=`expr $i + 1`
+  done > live
+
+  shuffle names $seed > order
+  head -40 order > rm1			# 40 of 95: below CompactPERCENT
+  sed 's/^f/g/' rm1 | head -30 > add1	# same lengths: into tombstones
+  {
+    echo "mkfs D2 1 blockmap $fmt"
+    awk '{ print "cp @in." $2, $1 }' live
+    echo "lslong"
+    sed 's/^/rm /' rm1
+    awk '{ print "cp @in." NR - 1, $0 }' add1
+    echo "lslong"
+  } > cmds
+
+  drop rm1
+  awk '{ print $0, NR - 1 }' add1 >> live
+
+  awk '{ print $1 }' live | shuffle - `expr $seed + 1` | head -50 > rm2
+  sed 's/^/rm /' rm2 >> cmds		# now past CompactPERCENT
+  echo "lslong" >> cmds
+  drop rm2
+  sed 's/^f/h/' names | head -40 > add2
+  awk '{ print "cp @in." NR + 9, $0 }' add2 >> cmds
+  awk '{ print $0, NR + 9 }' add2 >> live
+
+  awk '{ print "cp", $1, "@out." NR }' live >> cmds
+  echo "ls" >> cmds
+  echo "quit" >> cmds
+
+  $top/P0 < cmds > log 2>&1
+  bad=0
+  n=0
+  while read nm in; do
+    n=`expr $n + 1`
+    if ! cmp -s in.$in out.$n; then
+      echo "$fmt: $nm differs"
+      bad=`expr $bad + 1`
+    fi
+  done < live
+  awk '{ print $1 }' live | sort > want
+  sed '1,/cmd \[ls\]$/d' log | grep -- '-rw-rw-rw-' |
+    awk '{ print $NF }' | sort > got
+  if ! cmp -s want got; then
+    echo "$fmt: ls does not list the live names"
+    bad=`expr $bad + 1`
+  fi
+  echo "checkdirs $fmt: $n files, $bad errors"
+  nFail=`expr $nFail + $bad`
+  rm -f in.* out.* D?.dsk
+done
+test $nFail -eq 0
@@ -5,48 +5,203 @@
 
 #include "fs33types.hpp"
 
-/* pre:: nbits > 0;; post:: Construct fbv[], and initialize it to all
- * 1s. Also, write the bit vector to disk. Return the number of blocks
- * occupied. */
+/*
+ * The whole vector is kept in memory.  Changes mark the blocks they
+ * touch as dirty, and sync() writes back only those blocks.
+ *
+ * Over the vector is a summary: nFree[c] counts the 1 (free) bits of
+ * chunk c, bits ChunkBITS*c .. ChunkBITS*(c+1)-1, and bit c of
+ * anyFree[] is set iff nFree[c] > 0.  Searches skip whole chunks by
+ * the summary, and scan anyFree[] 64 chunks at a time, so they do not
+ * slow down as the volume fills.  The summary is recomputed when the
+ * vector is created or read, and kept up to date by setBit/setBits.
+ *
+ * The vector is split into at most GroupsMAX allocation groups of
+ * whole chunks, each with its own lock and next-fit hint.  A thread
+ * allocates from its home group, and from the others (in turn) only
+ * when that is exhausted, so threads rarely wait on one another.
+ * nFree[c] is guarded by the lock of the group of chunk c; the
+ * anyFree[] words, shared by groups, are updated atomically.
+ */
 
-uint BitVector::create(FileVolume * pfv, uint nbits, uint nblockbegin)
+enum {ChunkBITS = 4096, GroupsMAX = 16};
+
+BitVector::BitVector()
+{
+  fv = 0;
+  nBits = nBlockBegin = nBlocks = nChunks = nGroups = groupBits = 0;
+  bitVector = dirty = 0;
+  nFree = 0;
+  anyFree = 0;
+  locks = 0;
+  hints = 0;
+  nAllocs = nWords = 0;
+}
+
+BitVector::~BitVector()
+{
+  if (bitVector) alignedFree(bitVector);
+  delete [] dirty;
+  delete [] nFree;
+  delete [] anyFree;
+  for (uint g = 0; g < nGroups; g++)
+    pthread_mutex_destroy(&locks[g]);
+  delete [] locks;
+  delete [] hints;
+}
+
+/* pre:: nbits > 0;; post:: Get memory for a vector of nbits bits that
+ * begins at block nblockbegin.  Return the number of blocks it
+ * occupies, 0 if out of memory. */
+
+uint BitVector::allocate(FileVolume * pfv, uint nbits, uint nblockbegin)
 {
   fv = pfv;
   uint bsz = fv->superBlock.nBytesPerBlock;
-  bitVector = new byte[bsz];
-  if (bitVector == 0)
-    return 0;			// could not get mem for bitVector
-
   nBits = nbits;
   nBlockBegin = nblockbegin;
 
   uint nbytes = (nbits + 7) / 8; // so many bytes
-  uint nBlocksLong = (nbytes + bsz - 1) / bsz;
-  memset(bitVector, 0xFF, bsz);	// set all bits to free, i.e., 1
+  nBlocks = (nbytes + bsz - 1) / bsz;
+  nChunks = (nbits + ChunkBITS - 1) / ChunkBITS;
+  if (bitVector) alignedFree(bitVector);
+  delete [] dirty;
+  delete [] nFree;
+  delete [] anyFree;
+  for (uint g = 0; g < nGroups; g++)
+    pthread_mutex_destroy(&locks[g]);
+  delete [] locks;
+  delete [] hints;
+
+  uint groupChunks = (nChunks + GroupsMAX - 1) / GroupsMAX;
+  groupBits = groupChunks * ChunkBITS;
+  nGroups = (nChunks + groupChunks - 1) / groupChunks;
+  locks = new pthread_mutex_t[nGroups];
+  hints = new uint[nGroups];
+  for (uint g = 0; g < nGroups; g++) {
+    pthread_mutex_init(&locks[g], 0);
+    hints[g] = g * groupBits;
+  }
+  bitVector = (byte *) alignedAlloc(nBlocks * bsz);
+  dirty = new byte[nBlocks];
+  nFree = new uint[nChunks];
+  anyFree = new ulong[(nChunks + 63) / 64];
+  if (bitVector == 0)
+    return 0;			// could not get mem for bitVector
+  memset(dirty, 0, nBlocks);
+  memset(anyFree, 0, (nChunks + 63) / 64 * sizeof(ulong));
+  return nBlocks;
+}
+
+/* pre:: nbits > 0;; post:: Construct fbv[], and initialize it to all
+ * 1s. Also, write the bit vector to disk. Return the number of blocks
+ * occupied. */
+
+uint BitVector::create(FileVolume * pfv, uint nbits, uint nblockbegin)
+{
+  if (allocate(pfv, nbits, nblockbegin) == 0)
+    return 0;
+
+  uint bsz = fv->superBlock.nBytesPerBlock;
+  memset(bitVector, 0xFF, nBlocks * bsz);	// set all bits to free, i.e., 1
   // write the bit-vector to disk
-  for (uint i = 1; i < nBlocksLong; i++)
-    fv->writeBlock(nBlockBegin + i, bitVector);
+  if (nBlocks > 1)
+    fv->fillBlocks(nBlockBegin + 1, nBlocks - 1, bitVector);
   bitVector[0] = 0x7F;		// 0-th bit marked as in-use
   fv->writeBlock(nBlockBegin, bitVector);
+  summarize(0, nChunks);
 
   // mark the *blocks* used by the bit-vector as not free
-  for (uint bn = nBlockBegin + nBlocksLong - 1; bn >= nBlockBegin; bn--)
-    fv->fbvBlocks.setBit(bn, 0);
-  return nBlocksLong;
+  fv->fbvBlocks.setBits(nBlockBegin, nBlocks, 0);
+  return nBlocks;
 }
 
 uint BitVector::reCreate(FileVolume * pfv, uint nbits, uint nblockbegin)
 {
-  fv = pfv;
-  uint bsz = fv->superBlock.nBytesPerBlock;
-  bitVector = new byte[bsz];
-  if (bitVector == 0)
-    return 0;			// could not get mem for bitVector
+  if (allocate(pfv, nbits, nblockbegin) == 0)
+    return 0;
+  reload();
+  return nBlocks;
+}
 
-  nBits = nbits;
-  nBlockBegin = nblockbegin;
-  uint nbytes = (nbits + 7) / 8;	// so many bytes
-  return (nbytes + bsz - 1) / bsz;
+/* pre:: none;; post:: Write the dirty blocks of the vector to disk,
+ * each run of adjacent ones as one transfer.  Return the number of
+ * blocks written. */
+
+uint BitVector::sync()
+{
+  uint bsz = fv ? fv->superBlock.nBytesPerBlock : 0, n = 0;
+  for (uint i = 0, j; i < nBlocks; i = j + 1) {
+    for (; i < nBlocks && dirty[i] == 0; i++)
+      ;
+    for (j = i; j < nBlocks && dirty[j] != 0; j++)
+      dirty[j] = 0;
+    if (j > i)
+      fv->writeBlocks(nBlockBegin + i, j - i, bitVector + i * bsz);
+    n += j - i;
+  }
+  return n;
+}
+
+/* pre:: none;; post:: Discard the in-memory vector, and read it again
+ * from disk.  Return the number of blocks read. */
+
+uint BitVector::reload()
+{
+  if (nBlocks == 0)
+    return 0;
+  memset(dirty, 0, nBlocks);
+  uint n = fv->readBlocks(nBlockBegin, nBlocks, bitVector);
+  summarize(0, nChunks);
+  return n / fv->superBlock.nBytesPerBlock;
+}
+
+/* pre:: word xw is within the vector;; post:: Return it, with its
+ * lowest-numbered bit at the top.  Bytes hold their bits MSB first, so
+ * that is a byte-swapped load. */
+
+ulong BitVector::word(uint xw)
+{
+  ulong w;
+  memcpy(&w, bitVector + xw * 8, 8);
+  return __builtin_bswap64(w);
+}
+
+/* pre:: c0 <= c1 <= nChunks;; post:: Recount the free bits of chunks
+ * c0 .. c1-1, and set their anyFree bits to match. */
+
+void BitVector::summarize(uint c0, uint c1)
+{
+  for (uint c = c0; c < c1; c++) {
+    uint n = 0, e = (c + 1) * ChunkBITS;
+    if (e > nBits)
+      e = nBits;
+    for (uint xw = c * ChunkBITS / 64; xw * 64 < e; xw++) {
+      ulong w = word(xw);
+      if (e - xw * 64 < 64)
+	w &= ~(~0UL >> (e - xw * 64));	// bits at and beyond nBits
+      n += __builtin_popcountl(w);
+    }
+    nFree[c] = n;
+    markChunk(c);
+  }
+}
+
+void BitVector::markChunk(uint c)
+{
+  if (nFree[c] > 0)
+    __sync_fetch_and_or(&anyFree[c / 64], 1UL << (c % 64));
+  else
+    __sync_fetch_and_and(&anyFree[c / 64], ~(1UL << (c % 64)));
+}
+
+/* pre:: x <= nBits;; post:: The block that holds bit x is dirty. */
+
+void BitVector::touch(uint x)
+{
+  uint xblock = x / 8 / fv->superBlock.nBytesPerBlock;
+  if (xblock < nBlocks)
+    dirty[xblock] = 1;
 }
 
 /* pre:: none;; post:: return freeBit[x]. */
@@ -56,49 +211,385 @@ uint BitVector::getBit(uint x)
   if (x > nBits)
     return 0;			// illegal value
 
-  uint bsz = fv->superBlock.nBytesPerBlock;
-  uint xbyte = x / 8;		// bit index converted to byte index
-  uint xblock = xbyte / bsz;	// converted to block index
-  fv->readBlock(nBlockBegin + xblock, bitVector);
-
-  uint b = bitVector[xbyte % bsz];	// our needed bit is in b
+  uint b = bitVector[x / 8];	// our needed bit is in b
   uint f = x % 8;		// bit f of b is wanted
   b >>= 7 - f;			// right shift b by (7-f) positions
   return b & 1;			// return the last bit
 }
 
-/* pre:: v==0, or 1;; post:: freeBit[x] := v, and write it to the
- * disk;; */
+/* pre:: v==0, or 1;; post:: freeBit[x] := v;; */
 
 void BitVector::setBit(uint x, uint v)
 {
   if (x > nBits)
     return;			// illegal value
 
-  uint bsz = fv->superBlock.nBytesPerBlock;
-  uint xbyte = x / 8;		// bit index converted to byte index
-  uint xblock = xbyte / bsz;	// converted to block index
-  fv->readBlock(nBlockBegin + xblock, bitVector);
+  uint g = groupOf(x);
+  pthread_mutex_lock(&locks[g]);
+  setBitLocked(x, v);
+  pthread_mutex_unlock(&locks[g]);
+}
 
+void BitVector::setBitLocked(uint x, uint v)
+{
   uint f = x % 8;
   uint m = 1 << (7 - f);	// 00...010...0, bit 1 in the f-th position
-  uint b = bitVector[xbyte % bsz];
-  bitVector[xbyte % bsz] = (v != 0 ? b | m : b & ~m);
-  fv->writeBlock(nBlockBegin + xblock, bitVector);
+  uint b = bitVector[x / 8];
+  bitVector[x / 8] = (v != 0 ? b | m : b & ~m);
+  touch(x);
+  if (x < nBits && (b & m) != (bitVector[x / 8] & m)) {
+    uint c = x / ChunkBITS;
+    if (v != 0) nFree[c]++;
+    else nFree[c]--;
+    markChunk(c);
+  }
+}
+
+/* pre:: v==0, or 1;; post:: freeBit[x .. x+n-1] := v, taking the
+ * lock of each group the range touches in turn;; */
+
+void BitVector::setBits(uint x, uint n, uint v)
+{
+  if (x > nBits)
+    return;			// illegal value
+  if (n > nBits - x + 1)
+    n = nBits - x + 1;
+
+  while (n > 0) {
+    uint g = groupOf(x), m = (g + 1) * groupBits - x;
+    if (m > n) m = n;
+    pthread_mutex_lock(&locks[g]);
+    setBitsLocked(x, m, v);
+    pthread_mutex_unlock(&locks[g]);
+    x += m;
+    n -= m;
+  }
+}
+
+/* pre:: n > 0, x .. x+n-1 within one group whose lock we hold */
+
+void BitVector::setBitsLocked(uint x, uint n, uint v)
+{
+  touch(x);
+  touch(x + n - 1);
+  for (uint y = x / 8 / fv->superBlock.nBytesPerBlock + 1,
+	 e = (x + n - 1) / 8 / fv->superBlock.nBytesPerBlock; y < e; y++)
+    dirty[y] = 1;
+  uint c0 = x / ChunkBITS, c1 = (x + n - 1) / ChunkBITS + 1;
+  for (; n > 0 && x % 8 != 0; x++, n--)
+    putBit(x, v);
+  memset(bitVector + x / 8, (v != 0 ? 0xFF : 0), n / 8);
+  x += n / 8 * 8;
+  for (n %= 8; n > 0; x++, n--)
+    putBit(x, v);
+  summarize(c0, (c1 < nChunks ? c1 : nChunks));
+}
+
+void BitVector::putBit(uint x, uint v)
+{
+  uint m = 1 << (7 - x % 8);
+  bitVector[x / 8] = (v != 0 ? bitVector[x / 8] | m : bitVector[x / 8] & ~m);
+}
+
+/* pre:: x <= e <= nBits;; post:: Return the index of the first bit
+ * in x .. e-1 that equals v, or e if there is none.  Chunks with no
+ * such bit are skipped by the summary; within a chunk we go a word at
+ * a time, and clz counts up to the bit we want. */
+
+uint BitVector::findBit(uint x, uint e, uint v)
+{
+  uint nw = 0;
+  while (x < e) {
+    uint c = x / ChunkBITS, ce = (c + 1) * ChunkBITS;
+    if (v != 0 && nFree[c] == 0) {
+      x = nextFreeChunk(c + 1) * ChunkBITS;	// skip full chunks
+      continue;
+    }
+    if (v == 0 && nFree[c] == (ce < nBits ? ce : nBits) - c * ChunkBITS) {
+      x = ce;			// all of this chunk is free
+      continue;
+    }
+    if (ce > e)
+      ce = e;
+    for (uint xw = x / 64; xw * 64 < ce; xw++, nw++) {
+      ulong w = word(xw);
+      if (v == 0)
+	w = ~w;
+      if (xw == x / 64)
+	w &= ~0UL >> (x % 64);	// ignore bits before x
+      if (w != 0) {
+	uint y = xw * 64 + __builtin_clzl(w);
+	__sync_fetch_and_add(&nWords, nw + 1);
+	return (y < e ? y : e);
+      }
+    }
+    x = ce;
+  }
+  __sync_fetch_and_add(&nWords, nw);
+  return e;
+}
+
+/* pre:: none;; post:: Return the first chunk at or after c with a
+ * free bit, nChunks if none. */
+
+uint BitVector::nextFreeChunk(uint c)
+{
+  for (uint xw = c / 64; xw * 64 < nChunks; xw++) {
+    __sync_fetch_and_add(&nWords, 1);
+    ulong w = anyFree[xw];
+    if (xw == c / 64)
+      w &= ~0UL << (c % 64);
+    if (w != 0) {
+      uint y = xw * 64 + __builtin_ctzl(w);
+      return (y < nChunks ? y : nChunks);
+    }
+  }
+  return nChunks;
+}
+
+/* post:: Return the group bit x is in; x == nBits is in the last. */
+
+uint BitVector::groupOf(uint x)
+{
+  uint g = x / groupBits;
+  return (g < nGroups ? g : nGroups - 1);
+}
+
+static pthread_key_t homeKey;
+static pthread_once_t homeOnce = PTHREAD_ONCE_INIT;
+static uint nHomes = 0;
+
+static void makeHomeKey()
+{
+  pthread_key_create(&homeKey, 0);
+}
+
+/* post:: Return the home group of the calling thread.  Threads are
+ * given homes round-robin as they first allocate; the first one (the
+ * shell) gets group 0. */
+
+uint BitVector::homeGroup()
+{
+  pthread_once(&homeOnce, makeHomeKey);
+  ulong h = (ulong) pthread_getspecific(homeKey);
+  if (h == 0) {
+    h = __sync_add_and_fetch(&nHomes, 1);
+    pthread_setspecific(homeKey, (void *) h);
+  }
+  return (h - 1) % nGroups;
 }
 
 /* pre:: none ;; post:: Return the number i > 0 of a free bit, if
  * available i.e., freeBit[i] == 1 and set the bit to 0, 0
- * otherwise. */
+ * otherwise.  Within a group the search is next-fit: it starts at the
+ * last bit handed out there, and wraps around. */
 
 uint BitVector::getFreeBit()
 {
-  for (uint i = 1; i < nBits; i++)
-    if (getBit(i) == 1) {
-      setBit(i, 0);
-      return i;
+  for (uint k = 0, home = homeGroup(); k < nGroups; k++) {
+    uint g = (home + k) % nGroups;
+    uint lo = (g == 0 ? 1 : g * groupBits);	// bit 0 is never handed out
+    uint hi = (g + 1 < nGroups ? (g + 1) * groupBits : nBits);
+    pthread_mutex_lock(&locks[g]);
+    uint h = (hints[g] >= lo && hints[g] < hi ? hints[g] : lo);
+    uint x = findBit(h, hi, 1);
+    if (x >= hi && (x = findBit(lo, h, 1)) >= h)
+      x = hi;			// none free in group g
+    if (x < hi) {
+      setBitLocked(x, 0);
+      hints[g] = x;
+      __sync_fetch_and_add(&nAllocs, 1);
+      pthread_mutex_unlock(&locks[g]);
+      return x;
     }
+    pthread_mutex_unlock(&locks[g]);
+  }
   return 0;
 }
 
+/* pre:: n > 0, we hold the lock of group g;; post:: As allocRange(),
+ * but only within group g, and only if a run of at least minLen free
+ * bits is there.  */
+
+uint BitVector::allocIn(uint g, uint n, uint goal, uint policy,
+			uint * start, uint minLen)
+{
+  uint lo = (g == 0 ? 1 : g * groupBits);
+  uint hi = (g + 1 < nGroups ? (g + 1) * groupBits : nBits);
+  uint firstFit = (policy == allocFirstFit);
+  if (!firstFit || goal < lo || goal >= hi)
+    goal = lo;
+  uint best = 0, bestLen = 0, s, e, len;
+  uint from[2] = {goal, lo}, to[2] = {hi, goal};
+
+  for (uint pass = 0; pass < 2 && !(firstFit && bestLen >= n); pass++)
+    for (uint x = from[pass]; (s = findBit(x, to[pass], 1)) < to[pass];
+	 x = e) {
+      // first-fit need not measure a run beyond n
+      e = findBit(s, (firstFit && to[pass] - s > n ? s + n : to[pass]), 0);
+      len = e - s;
+      if (len >= n
+	  ? bestLen < n || len < bestLen
+	  : bestLen < n && len > bestLen) {
+	best = s;
+	bestLen = len;
+      }
+      if (bestLen >= n && (firstFit || bestLen == n))
+	break;
+    }
+  if (bestLen == 0 || bestLen < minLen)
+    return 0;
+  if (bestLen > n)
+    bestLen = n;
+  setBitsLocked(best, bestLen, 0);
+  *start = best;
+  return bestLen;
+}
+
+/* pre:: n > 0;; post:: Find a run of free bits, mark it in-use, and
+ * return its length, 0 if no bit is free.  The run is n long if such
+ * a run exists in some group, otherwise it is the longest run of the
+ * first group that has a free bit.  With allocFirstFit, the first run
+ * long enough at or after *start (wrapping around) is taken, so a
+ * caller can ask to continue where its last run ended; with
+ * allocBestFit, the shortest run long enough.  The group of *start,
+ * else the home group, is tried first.  Set *start to the first bit of
+ * the run.  Runs do not cross group boundaries. */
+
+uint BitVector::allocRange(uint n, uint * start, uint policy)
+{
+  uint goal = *start, len = 0;
+  uint g0 = (policy == allocFirstFit && goal >= 1 && goal < nBits
+	     ? groupOf(goal) : homeGroup());
+
+  for (uint pass = 0; pass < 2 && len == 0; pass++)	// full n, then less
+    for (uint k = 0; k < nGroups && len == 0; k++) {
+      uint g = (g0 + k) % nGroups;
+      uint c = nextFreeChunk(g * groupBits / ChunkBITS);
+      if (c >= nChunks || c * ChunkBITS >= (g + 1) * groupBits)
+	continue;		// nothing free in group g
+      pthread_mutex_lock(&locks[g]);
+      len = allocIn(g, n, goal, policy, start, (pass == 0 ? n : 1));
+      pthread_mutex_unlock(&locks[g]);
+    }
+  if (len > 0)
+    __sync_fetch_and_add(&nAllocs, 1);
+  return len;
+}
+
+/* post:: Return the number of free bits, from the summary. */
+
+uint BitVector::countFree()
+{
+  uint n = 0;
+  for (uint c = 0; c < nChunks; c++)
+    n += nFree[c];
+  return n;
+}
+
+/* pre:: x .. x+n-1 were allocated;; post:: Mark them free. */
+
+void BitVector::freeRange(uint x, uint n)
+{
+  if (x >= 1)
+    setBits(x, n, 1);
+}
+
+/* post:: Return the number of chunks whose summary (nFree[], anyFree[])
+ * does not match the vector. */
+
+uint BitVector::checkSummary()
+{
+  uint nBad = 0;
+  for (uint c = 0; c < nChunks; c++) {
+    uint n = nFree[c], any = (anyFree[c / 64] >> (c % 64)) & 1;
+    summarize(c, c + 1);	// recounted from the vector
+    if (n != nFree[c] || any != (nFree[c] > 0))
+      nBad++;
+  }
+  return nBad;
+}
+
+static uint nextRandom(uint * seed)
+{
+  *seed = *seed * 1103515245u + 12345u;
+  return *seed >> 8;
+}
+
+/* pre:: no one else allocates meanwhile;; post:: Do nOps random
+ * setBit/setBits/getFreeBit/allocRange/freeRange, from seed, checking
+ * each against a plain array of the bits, and every so often the
+ * summary; then put every bit back as it was.  Return the number of
+ * mismatches found, printing the first few. */
+
+uint BitVector::selfCheck(uint nOps, uint seed)
+{
+  byte * ref = new byte[nBits], * saved = new byte[nBits];
+  uint nRefFree = 0, nBad = 0;
+  for (uint x = 0; x < nBits; x++) {
+    saved[x] = ref[x] = getBit(x);
+    nRefFree += (x > 0 && ref[x]);
+  }
+  for (uint k = 0; k < nOps && nBits > 2; k++) {
+    uint op = nextRandom(&seed) % 5, x = 1 + nextRandom(&seed) % (nBits - 1);
+    uint n = 1 + nextRandom(&seed) % 200, v = nextRandom(&seed) % 2;
+    uint got = 0, len = 0, bad = 0;
+    if (n > nBits - x)
+      n = nBits - x;
+    switch (op) {
+    case 0:
+      setBit(x, v);
+      nRefFree += (v != 0) - (ref[x] != 0);
+      ref[x] = v;
+      break;
+    case 1:
+    case 4:
+      if (op == 4) {
+	freeRange(x, n);
+	v = 1;
+      } else
+	setBits(x, n, v);
+      for (uint y = x; y < x + n; y++) {
+	nRefFree += (v != 0) - (ref[y] != 0);
+	ref[y] = v;
+      }
+      break;
+    case 2:
+      got = getFreeBit();
+      bad = (got == 0 ? nRefFree > 0 : got >= nBits || ref[got] == 0);
+      if (!bad && got > 0) {
+	ref[got] = 0;
+	nRefFree--;
+      }
+      break;
+    case 3:
+      len = allocRange(n, &got, v);
+      bad = (len == 0 ? nRefFree > 0 : len > n || got == 0
+	     || got + len > nBits);
+      for (uint y = got; !bad && y < got + len; y++)
+	if (ref[y] == 0)
+	  bad = 1;
+	else {
+	  ref[y] = 0;
+	  nRefFree--;
+	}
+      break;
+    }
+    if (k % 1000 == 999 || k + 1 == nOps)
+      bad += (countFree() != nRefFree) + checkSummary();
+    if (k % 10000 == 9999 || k + 1 == nOps)
+      for (uint y = 1; y < nBits; y++)
+	bad += (getBit(y) != ref[y]);
+    if (bad && nBad++ < 5)
+      printf("bvcheck: op %u (%u at %u, n=%u) got %u, len %u\n",
+	     k, op, x, n, got, len);
+  }
+  for (uint x = 1; x < nBits; x++)
+    if (getBit(x) != saved[x])
+      setBit(x, saved[x]);
+  delete [] ref;
+  delete [] saved;
+  return nBad;
+}
+
 // -eof-
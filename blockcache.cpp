@@ -0,0 +1,331 @@
+/*
+ * blockcache.C -- write-back block cache of a FileVolume
+ */
+
+/*
+ * Cached blocks live on list T1 or T2; each has a data slot.  With
+ * the LRU policy only T1 is used, its head being the most recently
+ * used block.  With ARC, T1 holds blocks seen once recently and T2
+ * those seen at least twice; B1 and B2 are "ghosts", block numbers
+ * recently evicted from T1 and T2, that steer the target length of
+ * T1.  Unused nodes are on list Free.  Nodes are found by block
+ * number through a chained hash table.
+ */
+
+#include "fs33types.hpp"
+#include <sys/uio.h>
+
+#define NIL ((uint) ~0)
+
+BlockCache::BlockCache(FileVolume * pfv, uint n, uint pol)
+{
+  fv = pfv;
+  bsz = fv->superBlock.nBytesPerBlock;
+  nSlots = (n > 0 ? n : 1);
+  policy = pol;
+  nHits = nMisses = nWriteBacks = 0;
+  target = 0;
+
+  uint nNodes = 2 * nSlots;
+  nodes = new Node[nNodes];
+  for (uint h = 1; ; h <<= 1)
+    if (h >= nNodes) {
+      hashMask = h - 1;
+      break;
+    }
+  hash = new uint[hashMask + 1];
+  for (uint h = 0; h <= hashMask; h++)
+    hash[h] = NIL;
+  for (uint i = 0; i < nLists; i++) {
+    head[i] = tail[i] = NIL;
+    len[i] = 0;
+  }
+  for (uint x = 0; x < nNodes; x++) {
+    nodes[x].slot = NIL;
+    nodes[x].dirty = 0;
+    pushMRU(Free, x);
+  }
+  data = (byte *) alignedAlloc(nSlots * bsz);
+  freeSlots = new uint[nSlots];
+  for (nFreeSlots = 0; nFreeSlots < nSlots; nFreeSlots++)
+    freeSlots[nFreeSlots] = nSlots - 1 - nFreeSlots;
+}
+
+BlockCache::~BlockCache()
+{
+  flush();
+  alignedFree(data);
+  delete [] freeSlots;
+  delete [] hash;
+  delete [] nodes;
+}
+
+uint BlockCache::find(uint bn)
+{
+  uint x = hash[bn & hashMask];
+  while (x != NIL && nodes[x].nBlock != bn)
+    x = nodes[x].hnext;
+  return x;
+}
+
+void BlockCache::hashInsert(uint x)
+{
+  uint h = nodes[x].nBlock & hashMask;
+  nodes[x].hnext = hash[h];
+  hash[h] = x;
+}
+
+void BlockCache::hashRemove(uint x)
+{
+  uint * px = &hash[nodes[x].nBlock & hashMask];
+  while (*px != x)
+    px = &nodes[*px].hnext;
+  *px = nodes[x].hnext;
+}
+
+void BlockCache::unlink(uint x)
+{
+  Node * n = &nodes[x];
+  if (n->prev != NIL) nodes[n->prev].next = n->next;
+  else head[n->list] = n->next;
+  if (n->next != NIL) nodes[n->next].prev = n->prev;
+  else tail[n->list] = n->prev;
+  len[n->list]--;
+}
+
+void BlockCache::pushMRU(uint list, uint x)
+{
+  Node * n = &nodes[x];
+  n->list = list;
+  n->prev = NIL;
+  n->next = head[list];
+  if (head[list] != NIL) nodes[head[list]].prev = x;
+  else tail[list] = x;
+  head[list] = x;
+  len[list]++;
+}
+
+void BlockCache::moveTo(uint list, uint x)
+{
+  unlink(x);
+  pushMRU(list, x);
+}
+
+/* pre:: node x is in T1 or T2;; post:: Write its block back if
+ * dirty, and give up its data slot. */
+
+void BlockCache::dropData(uint x)
+{
+  Node * n = &nodes[x];
+  if (n->dirty) {
+    fv->diskBlocks(n->nBlock, 1, data + n->slot * bsz, 1);
+    nWriteBacks++;
+    n->dirty = 0;
+  }
+  freeSlots[nFreeSlots++] = n->slot;
+  n->slot = NIL;
+}
+
+/* ARC's REPLACE: free a data slot by demoting the LRU block of T1 or
+ * of T2 to a ghost. */
+
+void BlockCache::replace(uint inB2)
+{
+  if (nFreeSlots > 0)
+    return;
+  uint fromT1 = len[T1] > 0
+    && (len[T1] > target || (inB2 && len[T1] == target) || len[T2] == 0);
+  uint x = tail[fromT1 ? T1 : T2];
+  dropData(x);
+  moveTo(fromT1 ? B1 : B2, x);
+}
+
+/* pre:: none;; post:: Return the node that caches block bn, having
+ * made room for it if need be.  If fillFlag, its content is read from
+ * disk on a miss; otherwise the caller overwrites all of it.  Return
+ * NIL on a failed read. */
+
+uint BlockCache::load(uint bn, uint fillFlag)
+{
+  uint x = find(bn);
+  if (x != NIL && (nodes[x].list == T1 || nodes[x].list == T2)) {
+    nHits++;
+    moveTo(policy == cachePolicyARC ? T2 : T1, x);
+    return x;
+  }
+  nMisses++;
+
+  uint list = T1;
+  if (policy == cachePolicyLRU) {
+    if (nFreeSlots == 0) {	// evict the least recently used
+      uint v = tail[T1];
+      dropData(v);
+      hashRemove(v);
+      moveTo(Free, v);
+    }
+    x = tail[Free];
+    moveTo(T1, x);
+    nodes[x].nBlock = bn;
+    hashInsert(x);
+  } else if (x != NIL && nodes[x].list == B1) {
+    uint d = (len[B2] > len[B1] ? len[B2] / len[B1] : 1);
+    target = (target + d < nSlots ? target + d : nSlots);
+    replace(0);
+    list = T2;
+  } else if (x != NIL && nodes[x].list == B2) {
+    uint d = (len[B1] > len[B2] ? len[B1] / len[B2] : 1);
+    target = (target > d ? target - d : 0);
+    replace(1);
+    list = T2;
+  } else {
+    if (len[T1] + len[B1] == nSlots) {
+      if (len[T1] < nSlots) {
+	uint g = tail[B1];
+	hashRemove(g);
+	moveTo(Free, g);
+	replace(0);
+      } else {
+	uint v = tail[T1];
+	dropData(v);
+	hashRemove(v);
+	moveTo(Free, v);
+      }
+    } else if (len[T1] + len[T2] + len[B1] + len[B2] >= nSlots) {
+      if (len[T1] + len[T2] + len[B1] + len[B2] == 2 * nSlots) {
+	uint g = tail[B2];
+	hashRemove(g);
+	moveTo(Free, g);
+      }
+      replace(0);
+    }
+    x = tail[Free];
+    nodes[x].nBlock = bn;
+    hashInsert(x);
+  }
+  moveTo(list, x);
+
+  Node * n = &nodes[x];
+  n->slot = freeSlots[--nFreeSlots];
+  n->dirty = 0;
+  if (fillFlag && fv->diskBlocks(bn, 1, data + n->slot * bsz, 0) == 0) {
+    freeSlots[nFreeSlots++] = n->slot;
+    n->slot = NIL;
+    hashRemove(x);
+    moveTo(Free, x);
+    return NIL;
+  }
+  return x;
+}
+
+/* pre:: p[] is one block long;; post:: Copy block bn into p[], from
+ * the cache when we can.  Return the number of bytes copied. */
+
+uint BlockCache::read(uint bn, void * p)
+{
+  uint x = load(bn, 1);
+  if (x == NIL)
+    return 0;
+  memcpy(p, data + nodes[x].slot * bsz, bsz);
+  return bsz;
+}
+
+/* post:: Make p[] the content of block bn.  It reaches the disk on a
+ * flush(), or when the block is evicted. */
+
+uint BlockCache::write(uint bn, void * p)
+{
+  uint x = load(bn, 0);
+  memcpy(data + nodes[x].slot * bsz, p, bsz);
+  nodes[x].dirty = 1;
+  return bsz;
+}
+
+/* pre:: Blocks bn .. bn+count-1 have just been written to disk from
+ * p, p+stride, p+2*stride, ...;; post:: Cached copies of them agree
+ * with the disk, and are clean. */
+
+void BlockCache::update(uint bn, uint count, void * p, uint stride)
+{
+  for (uint i = 0; i < count; i++) {
+    uint x = find(bn + i);
+    if (x != NIL && (nodes[x].list == T1 || nodes[x].list == T2)) {
+      memcpy(data + nodes[x].slot * bsz, (byte *) p + i * stride, bsz);
+      nodes[x].dirty = 0;
+    }
+  }
+}
+
+/* post:: Dirty cached blocks among bn .. bn+count-1 are written to
+ * disk, so that a read that bypasses the cache sees them.  Return the
+ * number of blocks written. */
+
+uint BlockCache::writeBack(uint bn, uint count)
+{
+  uint nw = 0;
+  for (uint i = 0; i < count; i++) {
+    uint x = find(bn + i);
+    if (x != NIL && nodes[x].slot != NIL && nodes[x].dirty) {
+      fv->diskBlocks(bn + i, 1, data + nodes[x].slot * bsz, 1);
+      nodes[x].dirty = 0;
+      nw++;
+    }
+  }
+  nWriteBacks += nw;
+  return nw;
+}
+
+static int byBlockNumber(const void * a, const void * b)
+{
+  ulong x = *(ulong *) a, y = *(ulong *) b;
+  return x < y ? -1 : x > y;
+}
+
+/* post:: Write every dirty block back to disk, in block order, each
+ * run of adjacent blocks gathered into one transfer.  Return the
+ * number of blocks written. */
+
+uint BlockCache::flush()
+{
+  ulong * dirty = new ulong[nSlots];	// nBlock << 32 | node index
+  uint nd = 0;
+  for (uint list = T1; list <= T2; list++)
+    for (uint x = head[list]; x != NIL; x = nodes[x].next)
+      if (nodes[x].dirty)
+	dirty[nd++] = (ulong) nodes[x].nBlock << 32 | x;
+  qsort(dirty, nd, sizeof(ulong), byBlockNumber);
+
+  struct iovec * iov = new struct iovec[nd > 0 ? nd : 1];
+  uint nSecPerBlock = fv->superBlock.nSecPerBlock;
+  for (uint i = 0, j; i < nd; i = j) {
+    uint bn = dirty[i] >> 32;
+    for (j = i; j < nd && (dirty[j] >> 32) == bn + (j - i); j++) {
+      Node * n = &nodes[(uint) dirty[j]];
+      iov[j - i].iov_base = data + n->slot * bsz;
+      iov[j - i].iov_len = bsz;
+      n->dirty = 0;
+    }
+    fv->simDisk->writeSectorsv(bn * nSecPerBlock, iov, j - i);
+  }
+  nWriteBacks += nd;
+  delete [] iov;
+  delete [] dirty;
+  return nd;
+}
+
+/* post:: Flush, then forget every cached block, and the ARC history. */
+
+void BlockCache::discard()
+{
+  flush();
+  for (uint list = T1; list < Free; list++)
+    while (head[list] != NIL) {
+      uint x = head[list];
+      if (nodes[x].slot != NIL)
+	dropData(x);
+      hashRemove(x);
+      moveTo(Free, x);
+    }
+  target = 0;
+}
+
+// -eof-
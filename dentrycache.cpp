@@ -0,0 +1,172 @@
+/*
+ * dentrycache.C -- directory lookups remembered by a FileVolume
+ */
+
+/*
+ * Each entry says that in directory dir the name maps to i-number in,
+ * or, when in == 0, that dir has no such name.  Entries are found
+ * through a chained hash table on (dir, name), and are kept on one
+ * list, most recently used first; unused entries (dir == 0) are at
+ * the least recently used end, where a new entry is taken from.
+ * Names longer than DentryNameMAX are not cached.
+ */
+
+#include "fs33types.hpp"
+
+#define NIL ((uint) ~0)
+
+DentryCache::DentryCache(uint n)
+{
+  nEntries = (n > 0 ? n : 1);
+  nHits = nMisses = 0;
+  entries = new Entry[nEntries];
+  for (uint h = 1; ; h <<= 1)
+    if (h >= nEntries) {
+      hashMask = h - 1;
+      break;
+    }
+  hash = new uint[hashMask + 1];
+  for (uint h = 0; h <= hashMask; h++)
+    hash[h] = NIL;
+  mru = lru = NIL;
+  for (uint x = 0; x < nEntries; x++) {
+    entries[x].dir = 0;
+    push(x, 0);
+  }
+}
+
+DentryCache::~DentryCache()
+{
+  delete [] hash;
+  delete [] entries;
+}
+
+static uint hashOf(uint dir, byte * name)
+{
+  return hashName(name) ^ dir * 2654435761u;
+}
+
+uint DentryCache::find(uint dir, byte * name)
+{
+  uint x = hash[hashOf(dir, name) & hashMask];
+  while (x != NIL && (entries[x].dir != dir
+		      || strcmp((char *) entries[x].name, (char *) name)))
+    x = entries[x].hnext;
+  return x;
+}
+
+void DentryCache::hashRemove(uint x)
+{
+  uint * px = &hash[hashOf(entries[x].dir, entries[x].name) & hashMask];
+  while (*px != x)
+    px = &entries[*px].hnext;
+  *px = entries[x].hnext;
+}
+
+void DentryCache::unlink(uint x)
+{
+  Entry * e = &entries[x];
+  if (e->prev != NIL) entries[e->prev].next = e->next;
+  else mru = e->next;
+  if (e->next != NIL) entries[e->next].prev = e->prev;
+  else lru = e->prev;
+}
+
+/* post:: Put entry x at the most recently used end of the list if
+ * mruFlag, else at the least recently used end. */
+
+void DentryCache::push(uint x, uint mruFlag)
+{
+  Entry * e = &entries[x];
+  if (mruFlag) {
+    e->prev = NIL;
+    e->next = mru;
+    if (mru != NIL) entries[mru].prev = x;
+    else lru = x;
+    mru = x;
+  } else {
+    e->next = NIL;
+    e->prev = lru;
+    if (lru != NIL) entries[lru].next = x;
+    else mru = x;
+    lru = x;
+  }
+}
+
+/* post:: Make entry x unused. */
+
+void DentryCache::drop(uint x)
+{
+  hashRemove(x);
+  entries[x].dir = 0;
+  unlink(x);
+  push(x, 0);
+}
+
+static uint cacheable(byte * name)
+{
+  return name != 0 && name[0] != 0 && strlen((char *) name) <= DentryNameMAX;
+}
+
+/* pre:: dir > 0;; post:: If what name maps to in directory dir is
+ * cached, set *in to it, 0 meaning not there, and return 1.  Else
+ * return 0. */
+
+uint DentryCache::lookup(uint dir, byte * name, uint * in)
+{
+  uint x = (cacheable(name) ? find(dir, name) : NIL);
+  if (x == NIL) {
+    nMisses++;
+    return 0;
+  }
+  nHits++;
+  unlink(x);
+  push(x, 1);
+  *in = entries[x].in;
+  return 1;
+}
+
+/* pre:: dir > 0;; post:: Remember that name maps to in in directory
+ * dir; in == 0 means that dir has no file named name. */
+
+void DentryCache::enter(uint dir, byte * name, uint in)
+{
+  if (!cacheable(name))
+    return;
+  uint x = find(dir, name);
+  if (x == NIL) {
+    x = lru;
+    if (entries[x].dir != 0)
+      hashRemove(x);
+    entries[x].dir = dir;
+    strcpy((char *) entries[x].name, (char *) name);
+    uint h = hashOf(dir, name) & hashMask;
+    entries[x].hnext = hash[h];
+    hash[h] = x;
+  }
+  entries[x].in = in;
+  unlink(x);
+  push(x, 1);
+}
+
+/* post:: Forget every entry of directory dir, e.g., because dir has
+ * been deleted and its i-number may be reused. */
+
+void DentryCache::forgetDir(uint dir)
+{
+  for (uint x = 0; x < nEntries; x++)
+    if (entries[x].dir == dir)
+      drop(x);
+}
+
+/* post:: Forget all entries, as the directories may have been changed
+ * behind our back (see FileVolume::reload). */
+
+void DentryCache::discard()
+{
+  for (uint x = 0; x < nEntries; x++)
+    if (entries[x].dir != 0)
+      drop(x);
+}
+
+// -eof-
@@ -5,7 +5,8 @@
 
 #include "fs33types.hpp"
 
-#define iNumber(ptr) (*(ulong *) (ptr + strlen((char *)ptr) + 1))
+#define NIL ((uint) ~0)
+#define isStride (fv->superBlock.dFormat == dFormatStride)
 
 /* pre:: pfv must point to a proper file volume, in should be > 0;;
  * post:: Construct a directory object, parent == 0 means that on the
@@ -17,6 +18,10 @@ Directory:: Directory(FileVolume * pfv, uint in, uint parent)
   fv = pfv;
   dirf = 0;
   dirEntry = 0;
+  blockBuf = 0;
+  plusNames = 0;
+  bufBlock = NIL;
+  nextAt = entryAt = entryLen = 0;
   nInode = in;
   if (parent == 0)
     return;
@@ -25,11 +30,15 @@ Directory:: Directory(FileVolume * pfv, uint in, uint parent)
   fv->inodes.setType(in, iTypeDirectory);
   addLeafName((byte *) ".", in);
   addLeafName((byte *) "..", parent);
+  if (isStride)
+    placeEntry((byte *) HiddenNAME, 0, deadBytes());	// no index yet
 }
 
 Directory:: ~Directory()
 {
   this->namesEnd();
+  if (blockBuf) alignedFree(blockBuf);
+  delete [] plusNames;
 }
 
 /* pre:: dirEntry/dirf may or may not be 0;; post:: Get the next file
@@ -39,12 +48,11 @@ Directory:: ~Directory()
 
 byte * Directory::nextName()
 {
-  if (dirf == 0)
-    dirf = new File(fv, nInode);
-  if (dirEntry == 0)
-    dirEntry = new byte		// area of mem for file name + i-num
-      [fv->superBlock.fileNameLengthMax + 1 + fv->superBlock.iWidth];
+  namesBegin();
+  if (isStride)
+    return strideNextName();
 
+  entryAt = dirf->tellByte();
   byte * bp = dirEntry;
   while ((*bp = dirf->getNextByte()) != 0)
     bp++ ;
@@ -53,15 +61,44 @@ byte * Directory::nextName()
 
   for (uint i = 0; i < fv->superBlock.iWidth; i++) // deposit the i-number
     *++bp = dirf->getNextByte();
+  entryLen = bp + 1 - dirEntry;
   return dirEntry;
 }
 
+/* post:: dirf and dirEntry exist, and blockBuf if this directory is
+ * of stride format. */
+
+void Directory::namesBegin()
+{
+  if (dirf == 0)
+    dirf = new File(fv, nInode);
+  if (dirEntry == 0)
+    dirEntry = new byte		// area of mem for file name + i-num
+      [fv->superBlock.fileNameLengthMax + 1 + fv->superBlock.iWidth];
+  if (blockBuf == 0 && isStride)
+    blockBuf = (byte *) alignedAlloc(fv->superBlock.nBytesPerBlock);
+}
+
+/* pre:: offset is where an entry begins;; post:: Make it the one that
+ * nextName() returns next. */
+
+void Directory::seekEntry(uint offset)
+{
+  namesBegin();
+  if (isStride)
+    nextAt = offset;
+  else
+    dirf->seekByte(offset);
+}
+
 /* Must be called after invocation(s) of nextName(). */
 
 void Directory::namesEnd()
 {
   if (dirf) delete dirf;
   dirf = 0;
+  bufBlock = NIL;
+  nextAt = 0;
 #if 0
   if (dirEntry) delete dirEntry;
   dirEntry = 0;
@@ -76,49 +113,77 @@ byte * Directory::nameOf(uint in)
 {
   byte *bp = 0;
   while ((bp = nextName()) != 0) {
-    if (in == (uint)iNumber(bp))
+    if (bp[0] != TombBYTE && in == entryINumber(bp, fv->superBlock.iWidth))
       break;
   }
   namesEnd();
   return bp;
 }
 
+/* pre:: e[] is a name + i-number pair, as nextName() returns;; post::
+ * Return the i-number, the iWidth bytes after the name. */
+
+uint entryINumber(byte * e, uint iWidth)
+{
+  uint in = 0;
+  memcpy(&in, e + strlen((char *) e) + 1, iWidth);
+  return in;
+}
+
+/* post:: Return 1 if nm can name a file, 0 otherwise.  HiddenNAME,
+ * like every name not beginning with an alphanumeric or a dot, can
+ * not. */
+
+uint okNameSyntax(byte *nm)
+{
+  return
+    nm != 0			// null pointer?
+    && nm[0] != 0		// empty "" nm?
+    && isAlphaNumDot(nm[0])	// invalid begin char for name?
+    && index((char *) nm, '/') == 0	// nm contains a slash?
+    ;
+}
+
 /* pre:: ;; post:: Search directory and set dirEntry matching with
  * leafnm.  Return inumber.  Callers wish to use dirf and dirEntry
- * further; do not do namesEnd(). */
+ * further; do not do namesEnd().  A large directory is searched
+ * through its index (see dirindex.cpp). */
 
 uint Directory::setDirEntry(byte *leafnm)
 {
-  if (leafnm == 0 || leafnm[0] == 0)
-    return 0;
+  if (okNameSyntax(leafnm) == 0)
+    return 0;			// e.g., HiddenNAME
+
+  uint offset;
+  if (indexFind(leafnm, &offset))
+    return (offset == NIL ? 0 : entryINumber(dirEntry, fv->superBlock.iWidth));
+  if (isStride)
+    return strideFind(leafnm);
 
   uint nbToMatch = 1 + strlen((char *) leafnm), result = 0;
   for (byte * bp = 0; (bp = nextName());) {
     if (memcmp(bp, leafnm, nbToMatch) == 0) {
-      result = iNumber(bp);
+      result = entryINumber(bp, fv->superBlock.iWidth);
       break;
     }
   }
   return result;
 }
 
+/* pre:: ;; post:: Return the inumber of leafnm, 0 if it is not in
+ * this directory.  Answered from fv->dentries when it can be. */
+
 uint  Directory::iNumberOf(byte *leafnm)
 {
-  uint in = setDirEntry(leafnm);
+  uint in;
+  if (fv->dentries->lookup(nInode, leafnm, &in))
+    return in;
+  in = setDirEntry(leafnm);
   namesEnd();
+  fv->dentries->enter(nInode, leafnm, in);
   return in;
 }
 
-uint okNameSyntax(byte *nm)
-{
-  return
-    nm != 0			// null pointer?
-    && nm[0] != 0		// empty "" nm?
-    && isAlphaNumDot(nm[0])	// invalid begin char for name?
-    && index((char *) nm, '/') == 0	// nm contains a slash?
-    ;
-}
-
 /* pre:: none;; post:: Add file name newName with its inode number in
  * to this directory. */
 
@@ -134,13 +199,116 @@ void Directory::addLeafName(byte *newName, uint in)
     newName[newNameLength] = 0;
   }
 
-  if (setDirEntry(newName) == 0) {
-    memcpy(dirEntry, newName, newNameLength + 1);	// append NUL also
-    memcpy(dirEntry + newNameLength + 1, &in, fv->superBlock.iWidth);
-    dirf->appendBytes
-      (dirEntry, newNameLength + 1 + fv->superBlock.iWidth);
+  uint old, dead = deadBytes();
+  if (fv->dentries->lookup(nInode, newName, &old) == 0)
+    old = setDirEntry(newName);
+  namesEnd();
+  if (old == 0) {
+    uint offset = placeEntry(newName, in, dead);
+    indexAdd(newName, offset);
+    fv->dentries->enter(nInode, newName, in);
+  }
+  namesEnd();
+}
+
+/* pre:: rec[] has room for a record of name;; post:: Lay out the
+ * entry of name and i-number in, as this directory stores it, in
+ * rec[].  Return its length. */
+
+uint Directory::makeRecord(byte * name, uint in, byte * rec)
+{
+  uint iw = fv->superBlock.iWidth, len = strlen((char *) name);
+  if (!isStride) {
+    memcpy(rec, name, len + 1);	// append NUL also
+    memcpy(rec + len + 1, &in, iw);
+    return len + 1 + iw;
+  }
+  uint n = recordBytes(len);
+  memset(rec, 0, n);
+  memcpy(rec, &in, iw);
+  rec[iw] = len;
+  memcpy(rec + iw + 1, name, len);
+  return n;
+}
+
+/* pre:: none;; post:: Add the entry of name and i-number in to this
+ * directory, in a tombstone that it fits, else at the end.  What is
+ * left of a larger tombstone stays one.  dead is deadBytes().  Return
+ * the offset of the entry. */
+
+uint Directory::placeEntry(byte * name, uint in, uint dead)
+{
+  uint iw = fv->superBlock.iWidth, tombLen = 0;
+  byte * rec = new byte
+    [fv->superBlock.fileNameLengthMax + StrideBYTES + 2 * iw + 2];
+  uint len = makeRecord(name, in, rec);
+  uint offset = (dead >= len ? findTomb(len, &tombLen) : NIL);
+
+  namesBegin();
+  if (offset != NIL) {
+    uint nHead = 0;		// of the tombstone that is left
+    if (tombLen > len && !isStride)
+      rec[len + nHead++] = TombBYTE;
+    else if (tombLen > len) {
+      memset(rec + len, 0, iw);
+      rec[len + iw] = tombLen - len - iw - 1;
+      rec[len + iw + 1] = TombBYTE;
+      nHead = iw + 2;
+    }
+    dirf->writeBytes(offset, rec, len + nHead);
+    fv->dirDeadBytes[nInode] = dead - len;
+  } else if (isStride)
+    offset = strideAppend(rec, len);
+  else {
+    offset = fv->inodes.getFileSize(nInode);
+    dirf->appendBytes(rec, len);
+  }
+  namesEnd();
+  delete [] rec;
+  return offset;
+}
+
+/* post:: Return the live entries of this directory, in the order of
+ * the directory, each with the type and size of its inode; set *n to
+ * their number.  The names are gathered first, then the inodes are
+ * fetched in bulk, so a large directory costs one read per block of
+ * inodes, not one per entry.  The caller deletes the array; the names
+ * it points to last until the next readdirPlus() or ~Directory(). */
+
+DirEntryPlus * Directory::readdirPlus(uint * n)
+{
+  uint size = fv->inodes.getFileSize(nInode);
+  uint nMax = size / (2 + fv->superBlock.iWidth) + 1, used = 0;
+  DirEntryPlus * es = new DirEntryPlus[nMax];
+  uint * ins = new uint[nMax], * types = new uint[nMax];
+  uint * sizes = new uint[nMax];
+  delete [] plusNames;
+  plusNames = new byte[size + 1];
+
+  *n = 0;
+  namesEnd();
+  for (byte *bp = 0; *n < nMax && (bp = nextName());) {
+    if (isAlphaNumDot(bp[0]) == 0)
+      continue;			// a tombstone, or the index
+    uint len = strlen((char *) bp) + 1;
+    if (used + len > size + 1)
+      break;
+    es[*n].name = (byte *) memcpy(plusNames + used, bp, len);
+    used += len;
+    ins[(*n)++] = entryINumber(bp, fv->superBlock.iWidth);
   }
   namesEnd();
+
+  fv->inodes.getTypesAndSizes(ins, *n, types, sizes);
+  for (uint k = 0; k < *n; k++) {
+    es[k].in = ins[k];
+    es[k].type = types[k];
+    es[k].size = sizes[k];
+  }
+  delete [] ins;
+  delete [] types;
+  delete [] sizes;
+  return es;
 }
 
 /* pre:: in is valid;; post:: List the directory inode in's content in
@@ -151,14 +319,13 @@ uint Directory::lsPrivate(uint in, uint printfFlag)
 {
   uint nFiles = 0;
   Directory *d = new Directory(fv, in, 0);
-  for (byte *bp = 0; (bp = d->nextName()); nFiles++) {
-    uint in = iNumber(bp);
-    if (printfFlag) {
-      byte c = (d->fv->inodes.getType(in) == iTypeDirectory? 'd' : '-');
-      printf("%7d %crw-rw-rw-    1 yourName yourGroup %7d Jul 15 12:34 %s\n",
-	     in, c, d->fv->inodes.getFileSize(in), bp);
-    }
+  DirEntryPlus * es = d->readdirPlus(&nFiles);
+  for (uint k = 0; printfFlag && k < nFiles; k++) {
+    byte c = (es[k].type == iTypeDirectory? 'd' : '-');
+    printf("%7d %crw-rw-rw-    1 yourName yourGroup %7d Jul 15 12:34 %s\n",
+	   es[k].in, c, es[k].size, es[k].name);
   }
+  delete [] es;
   delete d;
   return nFiles - 2;		// -2 because of "." and ".."
 }
@@ -170,6 +337,8 @@ uint Directory::ls()
 
 uint Directory::createFile(byte *leafnm, uint dirFlag)
 {
+  if (okNameSyntax(leafnm) == 0)
+    return 0;
   uint in = iNumberOf(leafnm);
   if (in  == 0) {
     in = fv->inodes.getFree();
@@ -184,25 +353,169 @@ uint Directory::createFile(byte *leafnm, uint dirFlag)
   return in;
 }
 
-/* Do not delete if it is dot or dotdot.  Do not delete if it is a
- * non-empty dir. */
+/*
+ * Deleting an entry only overwrites the first byte of its name with
+ * TombBYTE, which no name begins with.  The entry stays, as a
+ * tombstone that nextName() still returns but that lookups never
+ * match, until addLeafName() reuses it for a name that fits or
+ * compact() squeezes it out.  The bytes of tombstones are counted in
+ * fv->dirDeadBytes[]; once they exceed CompactPERCENT of the
+ * directory, it is compacted.
+ */
+
+/* pre:: none;; post:: Return the number of bytes of tombstones in
+ * this directory, counting them if it has not been done since the
+ * volume was (re)loaded.  Do not call it in the midst of nextName()s. */
+
+uint Directory::deadBytes()
+{
+  if (fv->dirDeadBytes == 0) {
+    fv->dirDeadBytes = new uint[fv->superBlock.nInodes];
+    for (uint i = 0; i < fv->superBlock.nInodes; i++)
+      fv->dirDeadBytes[i] = NIL;
+  }
+  uint * p = &fv->dirDeadBytes[nInode];
+  if (*p == NIL) {
+    *p = 0;
+    for (byte * bp = 0; (bp = nextName());)
+      if (bp[0] == TombBYTE)
+	*p += entryLen;
+    namesEnd();
+  }
+  return *p;
+}
+
+/* pre:: none;; post:: Return the offset of a tombstone that an entry
+ * of len bytes can take, NIL if there is none: one of len bytes, or
+ * one long enough that the rest of it can remain a tombstone.  Set
+ * *tombLen to its length. */
+
+uint Directory::findTomb(uint len, uint * tombLen)
+{
+  uint iw = fv->superBlock.iWidth, offset = NIL;
+  for (byte * bp = 0; (bp = nextName());) {
+    uint n = entryLen;
+    if (bp[0] == TombBYTE
+	&& (n == len || n >= len + (isStride ? StrideBYTES : 2 + iw))) {
+      offset = entryAt;
+      *tombLen = n;
+      break;
+    }
+  }
+  namesEnd();
+  return offset;
+}
+
+/* pre:: p[0..n-1] holds this directory from its first entry on;;
+ * post:: Return the length of the entry at offset x, 0 if there is
+ * none. */
+
+uint Directory::recordSize(byte * p, uint n, uint x)
+{
+  uint bsz = fv->superBlock.nBytesPerBlock, iw = fv->superBlock.iWidth;
+  if (!isStride)
+    return (x < n && p[x] != 0 ? nextEntry(p, n, x, iw) - x : 0);
+  return (x % bsz + iw + 1 <= bsz && p[x + iw] != 0
+	  ? recordBytes(p[x + iw]) : 0);
+}
+
+/* pre:: none;; post:: Rewrite this directory without its tombstones,
+ * and release the blocks that it no longer needs.  Its index, if it
+ * has one, is rebuilt. */
+
+void Directory::compact()
+{
+  uint bsz = fv->superBlock.nBytesPerBlock, iw = fv->superBlock.iWidth;
+  uint size = fv->inodes.getFileSize(nInode);
+  uint nBlocks = (size + bsz - 1) / bsz, nameAt = (isStride ? iw + 1 : 0);
+  byte * buf = (byte *) alignedAlloc(nBlocks * bsz);
+  File * f = new File(fv, nInode);
+
+  if (f->readBlocks(0, nBlocks, buf) == size) {
+    uint y = 0, first = size;
+    for (uint x = 0, n; x < size; x += n) {
+      if ((n = recordSize(buf, size, x)) == 0) {
+	if (!isStride)
+	  break;
+	n = bsz - x % bsz;	// the zeros that end a block
+	continue;
+      }
+      if (buf[x + nameAt] == TombBYTE) {
+	if (first == size) first = x;
+	continue;
+      }
+      if (isStride && y % bsz + n > bsz) {	// on to the next block
+	memset(buf + y, 0, bsz - y % bsz);
+	y += bsz - y % bsz;
+      }
+      memmove(buf + y, buf + x, n);
+      y += n;
+    }
+    memset(buf + y, 0, nBlocks * bsz - y);
+    uint nKeep = (y + bsz - 1) / bsz;
+    if (isStride)
+      y = nKeep * bsz;
+    for (uint k = first / bsz; k < nKeep; k++)
+      f->writeBlock(k, buf + k * bsz);
+    for (uint k = nBlocks; k > nKeep; k--) {	// last block is by size
+      fv->inodes.setLastBlockNumber(nInode, 0);
+      fv->inodes.setFileSize(nInode, (k - 1) * bsz);
+    }
+    fv->inodes.setFileSize(nInode, y);
+    fv->dirDeadBytes[nInode] = 0;
+  }
+  delete f;
+  alignedFree(buf);
+  if (indexInode(0) > 0)
+    indexBuild();		// the entries have moved
+}
+
+/* Do not delete if it is dot or dotdot, or the index.  Do not delete
+ * if it is a non-empty dir. */
 
 uint Directory::deleteFile(byte *leafnm, uint freeInodeFlag)
 {
   if (strcmp((char *) leafnm, ".") == 0 ||
-      strcmp((char *) leafnm, "..") == 0) return 0;
-
-  uint in = setDirEntry(leafnm);
+      strcmp((char *) leafnm, "..") == 0 ||
+      okNameSyntax(leafnm) == 0) return 0;
+
+  uint in;
+  if (fv->dentries->lookup(nInode, leafnm, &in) && in == 0)
+    return 0;			// known not to be here
+  uint dead = deadBytes();
+  in = setDirEntry(leafnm);
   if (in > 0) {
-    dirf->deletePrecedingBytes
-      (1 + strlen((char *) leafnm) + fv->superBlock.iWidth);
-    if (freeInodeFlag) fv->inodes.setFree(in);
+    uint len = entryLen, offset = entryAt;
+    byte tomb = TombBYTE;
+    dirf->writeBytes(offset + (isStride ? fv->superBlock.iWidth + 1 : 0),
+		     &tomb, 1);
+    namesEnd();
+    indexRemove(leafnm, offset);
+    fv->dirDeadBytes[nInode] = dead += len;
+    if (dead * 100 > fv->inodes.getFileSize(nInode) * CompactPERCENT)
+      compact();
+    if (freeInodeFlag) {
+      if (fv->inodes.getType(in) == iTypeDirectory) {
+	Directory * d = new Directory(fv, in, 0);
+	uint idx = d->indexInode(0);
+	delete d;
+	if (idx > 0) fv->inodes.setFree(idx);
+	fv->dentries->forgetDir(in);
+	fv->dirDeadBytes[in] = NIL;
+	fv->dirIndexes[in] = NIL;
+      }
+      fv->inodes.setFree(in);
+    }
   }
+  namesEnd();
+  fv->dentries->enter(nInode, leafnm, 0);
   return in;
 }
 
 /* pre:: pn is a dir inode, leafnm != 0, leafnm[0] != 0;; post:: Move
  * file named leafnm whose current parent is pn into this directory.;;
+ * It must enter 0 for leafnm of pn, and the i-number for leafnm of
+ * this directory, into fv->dentries.
  */
 
 uint Directory::moveFile(uint pn, byte * leafnm)
@@ -0,0 +1,282 @@
+/*
+ * dirindex.C -- hashed index of a large directory
+ */
+
+/*
+ * Once a directory grows beyond IndexMinBLOCKS blocks, it gets an
+ * index: a file of nBuckets blocks, nBuckets a power of 2 and so the
+ * file size / bsz.  Each block is a bucket: a count, then that many
+ * (hash, offset) pairs, offset being where in the directory an entry
+ * whose name has that hash begins.  The entries themselves stay where
+ * they were; the index only says where to look.  The i-number of the
+ * index is that of the entry named HiddenNAME, always the third in the
+ * directory, after . and .. -- a name users can not make (see
+ * okNameSyntax), and that ls and rm pass over.  So a lookup reads block
+ * 0 of the directory, one bucket, and the block(s) of the entry, no
+ * matter how large the directory is.  A bucket that overflows doubles
+ * the number of buckets.  Deleted entries (tombstones) are not in the
+ * index; compacting the directory moves entries, so the index is then
+ * rebuilt.
+ */
+
+#include "fs33types.hpp"
+
+#define NIL ((uint) ~0)
+#define isStride (fv->superBlock.dFormat == dFormatStride)
+
+enum {IndexMinBLOCKS = 4};
+
+/* FNV-1a */
+
+uint hashName(byte * nm)
+{
+  uint h = 2166136261u;
+  while (*nm)
+    h = (h ^ *nm++) * 16777619u;
+  return h;
+}
+
+/* pre:: p[0..n-1] holds directory entries from the first on;; post::
+ * Return the offset of the entry after the one at offset x, or n if
+ * there is no whole entry at x. */
+
+uint Directory::nextEntry(byte * p, uint n, uint x, uint iWidth)
+{
+  byte * z = (x < n ? (byte *) memchr(p + x, 0, n - x) : 0);
+  return (z != 0 && z + 1 + iWidth <= p + n ? z + 1 + iWidth - p : n);
+}
+
+/* pre:: none;; post:: Return the i-number of the index of this
+ * directory, 0 if it has none.  If at != 0, set *at to the offset of
+ * that i-number in the directory.  The i-number is remembered in
+ * fv->dirIndexes[], so that block 0 is read only the first time, or
+ * when *at is wanted. */
+
+uint Directory::indexInode(uint * at)
+{
+  if (fv->dirIndexes == 0) {
+    fv->dirIndexes = new uint[fv->superBlock.nInodes];
+    for (uint i = 0; i < fv->superBlock.nInodes; i++)
+      fv->dirIndexes[i] = NIL;
+  }
+  uint * p = &fv->dirIndexes[nInode];
+  if (*p != NIL && at == 0)
+    return *p;
+
+  uint bsz = fv->superBlock.nBytesPerBlock, iw = fv->superBlock.iWidth;
+  uint in = 0;
+  byte * buf = (byte *) alignedAlloc(bsz);
+  File * f = new File(fv, nInode);
+  uint n = f->readBlock(0, buf);
+  delete f;
+
+  uint x, y;			// the name, the i-number of the third entry
+  if (isStride) {
+    x = recordSize(buf, n, 0);
+    y = x + recordSize(buf, n, x);
+    x = y + iw + 1;
+    if (y + iw + 1 > n || buf[y + iw] != sizeof(HiddenNAME) - 1)
+      x = n;
+  } else {
+    x = nextEntry(buf, n, nextEntry(buf, n, 0, iw), iw);
+    y = x + sizeof(HiddenNAME);
+  }
+  if (x + sizeof(HiddenNAME) - 1 <= n && y + iw <= n
+      && memcmp(buf + x, HiddenNAME, sizeof(HiddenNAME) - 1) == 0) {
+    memcpy(&in, buf + y, iw);
+    if (at != 0)
+      *at = y;
+  }
+  alignedFree(buf);
+  return *p = in;
+}
+
+/* pre:: leafnm != 0;; post:: If this directory has no index, return
+ * 0.  Else return 1, with *offset set to where the entry named leafnm
+ * begins, NIL if there is none.  When there is one, it is in dirEntry,
+ * and dirf is positioned just past it, as after nextName(). */
+
+uint Directory::indexFind(byte * leafnm, uint * offset)
+{
+  uint idx = indexInode(0);
+  if (idx == 0)
+    return 0;
+
+  uint bsz = fv->superBlock.nBytesPerBlock, h = hashName(leafnm);
+  uint nBuckets = fv->inodes.getFileSize(idx) / bsz;
+  uint * ib = (uint *) alignedAlloc(bsz);
+  File * xf = new File(fv, idx);
+  uint nr = xf->readBlock(h & (nBuckets - 1), ib);
+  delete xf;
+
+  *offset = NIL;
+  namesBegin();
+  for (uint i = 0; nr > 0 && i < ib[0]; i++)
+    if (ib[1 + 2 * i] == h) {
+      seekEntry(ib[2 + 2 * i]);
+      byte * bp = nextName();
+      if (bp != 0 && strcmp((char *) bp, (char *) leafnm) == 0) {
+	*offset = ib[2 + 2 * i];
+	break;
+      }
+    }
+  alignedFree(ib);
+  return 1;
+}
+
+/* pre:: an entry named leafnm has just been appended to this directory
+ * at offset;; post:: Enter it into the index, building the index if
+ * the directory has become large enough to need one. */
+
+void Directory::indexAdd(byte * leafnm, uint offset)
+{
+  uint bsz = fv->superBlock.nBytesPerBlock;
+  uint idx = indexInode(0);
+  if (idx == 0) {
+    if (fv->inodes.getFileSize(nInode) > IndexMinBLOCKS * bsz)
+      indexBuild();
+    return;
+  }
+
+  uint cap = (bsz / fv->superBlock.iWidth - 1) / 2, h = hashName(leafnm);
+  uint nBuckets = fv->inodes.getFileSize(idx) / bsz;
+  uint * ib = (uint *) alignedAlloc(bsz);
+  File * xf = new File(fv, idx);
+  xf->readBlock(h & (nBuckets - 1), ib);
+  uint c = ib[0];
+  if (c < cap) {
+    ib[1 + 2 * c] = h;
+    ib[2 + 2 * c] = offset;
+    ib[0] = c + 1;
+    xf->writeBlock(h & (nBuckets - 1), ib);
+  }
+  delete xf;
+  alignedFree(ib);
+  if (c == cap)
+    indexBuild();		// with more buckets
+}
+
+/* pre:: the entry named leafnm at offset has just been deleted;;
+ * post:: Remove it from the index, if there is one. */
+
+void Directory::indexRemove(byte * leafnm, uint offset)
+{
+  uint idx = indexInode(0);
+  if (idx == 0)
+    return;
+
+  uint bsz = fv->superBlock.nBytesPerBlock, h = hashName(leafnm);
+  uint nBuckets = fv->inodes.getFileSize(idx) / bsz;
+  uint * ib = (uint *) alignedAlloc(bsz);
+  File * xf = new File(fv, idx);
+  uint nr = xf->readBlock(h & (nBuckets - 1), ib);
+  for (uint i = 0; nr > 0 && i < ib[0]; i++)
+    if (ib[1 + 2 * i] == h && ib[2 + 2 * i] == offset) {
+      uint last = --ib[0];	// the last pair takes its place
+      ib[1 + 2 * i] = ib[1 + 2 * last];
+      ib[2 + 2 * i] = ib[2 + 2 * last];
+      xf->writeBlock(h & (nBuckets - 1), ib);
+      break;
+    }
+  delete xf;
+  alignedFree(ib);
+}
+
+/* pre:: this directory is of the stream format, and has no
+ * HiddenNAME entry;; post:: Insert one, with i-number 0, after . and
+ * .., and return the offset of that i-number, 0 if it could not be
+ * done. */
+
+uint Directory::indexMakeRoom()
+{
+  uint bsz = fv->superBlock.nBytesPerBlock, iw = fv->superBlock.iWidth;
+  uint hl = sizeof(HiddenNAME) + iw, at = 0;
+  uint size = fv->inodes.getFileSize(nInode);
+  uint nBlocks = (size + bsz - 1) / bsz;
+
+  byte * buf = (byte *) alignedAlloc((nBlocks + 1) * bsz);
+  memset(buf, 0, (nBlocks + 1) * bsz);
+  File * f = new File(fv, nInode);
+  if (f->readBlocks(0, nBlocks, buf) == size) {
+    uint x = nextEntry(buf, size, nextEntry(buf, size, 0, iw), iw);
+    memmove(buf + x + hl, buf + x, size - x);
+    memcpy(buf + x, HiddenNAME, sizeof(HiddenNAME));
+    for (uint k = 0; k < nBlocks; k++)
+      f->writeBlock(k, buf + k * bsz);
+    f->appendBytes(buf + size, hl);
+    at = x + sizeof(HiddenNAME);
+  }
+  delete f;
+  alignedFree(buf);
+  return at;
+}
+
+/* pre:: none;; post:: (Re)build the index of this directory from one
+ * pass over its entries, with the fewest buckets that hold them all
+ * with room to spare.  A directory indexed for the first time gets
+ * its HiddenNAME entry inserted after . and .. */
+
+void Directory::indexBuild()
+{
+  uint bsz = fv->superBlock.nBytesPerBlock, iw = fv->superBlock.iWidth;
+  uint at = 0, old = indexInode(&at);
+  if (at == 0 && (isStride || (at = indexMakeRoom()) == 0))
+    return;
+
+  uint nMax = fv->inodes.getFileSize(nInode) / (2 + iw) + 1, n = 0;
+  uint * hs = new uint[nMax], * offs = new uint[nMax];
+  namesEnd();
+  for (byte * bp = 0; n < nMax && (bp = nextName());)
+    if (bp[0] != TombBYTE && strcmp((char *) bp, HiddenNAME) != 0) {
+      hs[n] = hashName(bp);
+      offs[n++] = entryAt;
+    }
+  namesEnd();
+
+  uint nBuckets = 1, cap = (bsz / iw - 1) / 2;
+  while (nBuckets * cap / 2 < n)
+    nBuckets *= 2;
+  uint * table;
+  for (;;) {
+    table = new uint[nBuckets * bsz / iw];
+    memset(table, 0, nBuckets * bsz);
+    uint full = 0;
+    for (uint i = 0; i < n && !full; i++) {
+      uint * b = table + (hs[i] & (nBuckets - 1)) * (bsz / iw);
+      if (b[0] == cap)
+	full = 1;
+      else {
+	b[1 + 2 * b[0]] = hs[i];
+	b[2 + 2 * b[0]] = offs[i];
+	b[0]++;
+      }
+    }
+    if (!full)
+      break;
+    delete [] table;
+    nBuckets *= 2;
+  }
+  delete [] hs;
+  delete [] offs;
+
+  if (old > 0)
+    fv->inodes.setFree(old);
+  uint idx = fv->inodes.getFree();
+  if (idx > 0) {
+    fv->inodes.setType(idx, iTypeOrdinary);
+    File * xf = new File(fv, idx);
+    uint nw = xf->appendBytes((byte *) table, nBuckets * bsz);
+    delete xf;
+    if (nw != nBuckets * bsz) {
+      fv->inodes.setFree(idx);
+      idx = 0;			// no index after all
+    }
+  }
+  delete [] table;
+  File * f = new File(fv, nInode);
+  f->writeBytes(at, (byte *) &idx, iw);
+  delete f;
+  fv->dirIndexes[nInode] = idx;
+}
+
+// -eof-
@@ -0,0 +1,150 @@
+/*
+ * dirstride.C -- the fixed-stride format of directories
+ */
+
+/*
+ * On a volume made with superBlock.dFormat == dFormatStride, a
+ * directory entry is a record of a multiple of StrideBYTES bytes: the
+ * i-number (iWidth bytes), the length of the name (one byte), the
+ * name, and zeros to the end of the record.  Records never cross a
+ * block boundary.  The records of a block are followed by zeros, so a
+ * name length of 0 ends them, and the directory grows a block at a
+ * time.  A name is looked up by laying it out as a record, the probe,
+ * and comparing the records of each block with it StrideBYTES bytes at
+ * a time, with SSE2 where the compiler has it.  nextName() turns each
+ * record into the name + i-number form that the rest of Directory
+ * uses.  As in the other format, a tombstone is an entry whose name
+ * begins with TombBYTE.  The third record of a directory is always
+ * HiddenNAME, made with the directory, so that an index never has to
+ * be inserted in front of other entries.
+ */
+
+#include "fs33types.hpp"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define NIL ((uint) ~0)
+
+/* pre:: a[] and b[] are records of n bytes;; post:: Return 1 if they
+ * are the same but for the i-numbers in their first iWidth bytes, 0
+ * otherwise. */
+
+static uint sameKey(byte * a, byte * b, uint n, uint iWidth)
+{
+#ifdef __SSE2__
+  uint skip = (1 << iWidth) - 1;
+  for (uint i = 0; i < n; i += StrideBYTES, skip = 0) {
+    __m128i va = _mm_loadu_si128((__m128i *) (a + i));
+    __m128i vb = _mm_loadu_si128((__m128i *) (b + i));
+    if (((uint) _mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) | skip) != 0xffff)
+      return 0;
+  }
+  return 1;
+#else
+  return memcmp(a + iWidth, b + iWidth, n - iWidth) == 0;
+#endif
+}
+
+/* post:: Return the number of bytes of the record of a name of len
+ * bytes. */
+
+uint Directory::recordBytes(uint len)
+{
+  uint n = fv->superBlock.iWidth + 1 + len;
+  return (n + StrideBYTES - 1) / StrideBYTES * StrideBYTES;
+}
+
+/* pre:: p[] is a block of this directory;; post:: Return the offset
+ * in it just past its last record. */
+
+uint Directory::recordsEnd(byte * p)
+{
+  uint bsz = fv->superBlock.nBytesPerBlock, iw = fv->superBlock.iWidth;
+  uint x = 0;
+  while (x + iw + 1 <= bsz && p[x + iw] != 0)
+    x += recordBytes(p[x + iw]);
+  return x;
+}
+
+/* pre:: namesBegin();; post:: As nextName(), for a directory of
+ * stride format.  A block is read when the first of its records is
+ * wanted. */
+
+byte * Directory::strideNextName()
+{
+  uint bsz = fv->superBlock.nBytesPerBlock, iw = fv->superBlock.iWidth;
+  for (;;) {
+    uint k = nextAt / bsz, x = nextAt % bsz;
+    if (k != bufBlock) {
+      if (dirf->readBlock(k, blockBuf) < bsz)
+	return 0;		// end of directory
+      bufBlock = k;
+    }
+    uint len = (x + iw + 1 <= bsz ? blockBuf[x + iw] : 0);
+    if (len == 0) {
+      nextAt = (k + 1) * bsz;	// no more records in this block
+      continue;
+    }
+    entryAt = nextAt;
+    entryLen = recordBytes(len);
+    nextAt += entryLen;
+    memcpy(dirEntry, blockBuf + x + iw + 1, len);
+    dirEntry[len] = 0;
+    memcpy(dirEntry + len + 1, blockBuf + x, iw);
+    return dirEntry;
+  }
+}
+
+/* pre:: leafnm != 0, leafnm[0] != 0;; post:: As setDirEntry(), for a
+ * directory of stride format: scan it a whole block at a time for the
+ * record of leafnm. */
+
+uint Directory::strideFind(byte * leafnm)
+{
+  uint bsz = fv->superBlock.nBytesPerBlock, iw = fv->superBlock.iWidth;
+  uint len = strlen((char *) leafnm);
+  if (len >= fv->superBlock.fileNameLengthMax)
+    return 0;			// can not be here
+
+  byte * probe = new byte[recordBytes(len)];
+  uint n = makeRecord(leafnm, 0, probe), found = 0;
+  namesBegin();
+  for (uint k = 0; !found && dirf->readBlock(k, blockBuf) == bsz; k++) {
+    bufBlock = k;
+    for (uint x = 0, l; x + iw + 1 <= bsz && (l = blockBuf[x + iw]) != 0;
+	 x += recordBytes(l))
+      if (l == len && sameKey(blockBuf + x, probe, n, iw)) {
+	nextAt = k * bsz + x;
+	found = 1;
+	break;
+      }
+  }
+  delete [] probe;
+  return (found && strideNextName() != 0 ? entryINumber(dirEntry, iw) : 0);
+}
+
+/* pre:: rec[] is a record of len bytes;; post:: Put it after the last
+ * record of the last block of this directory, or if it does not fit
+ * there, as the first record of a new block.  Return its offset. */
+
+uint Directory::strideAppend(byte * rec, uint len)
+{
+  uint bsz = fv->superBlock.nBytesPerBlock;
+  uint k = fv->inodes.getFileSize(nInode) / bsz, x = bsz;
+  namesBegin();
+  bufBlock = NIL;
+  if (k > 0 && dirf->readBlock(k - 1, blockBuf) == bsz)
+    x = recordsEnd(blockBuf);
+  if (x + len <= bsz) {
+    memcpy(blockBuf + x, rec, len);
+    dirf->writeBlock(k - 1, blockBuf);
+    return (k - 1) * bsz + x;
+  }
+  memset(blockBuf, 0, bsz);
+  memcpy(blockBuf, rec, len);
+  dirf->appendBytes(blockBuf, bsz);
+  return k * bsz;
+}
+
+// -eof-
@@ -0,0 +1,485 @@
+/*
+ * diskqueue.C -- asynchronous sector I/O on a SimDisk
+ */
+
+/*
+ * A DiskQueue lets a caller have many sector transfers of one SimDisk
+ * in flight.  There are three backends, chosen by newDiskQueue():
+ *
+ * * UringQueue: Linux io_uring, driven through the raw system calls.
+ * * ThreadQueue: worker threads doing the usual preadv/pwritev or
+ *   memcpy; used where io_uring is missing, and for mmap-ed disks.
+ * * SyncQueue: a depth of one; the transfer is done in submit().
+ */
+
+#include "fs33types.hpp"
+#include <errno.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#ifdef __linux__
+#include <linux/io_uring.h>
+#endif
+
+#if defined(__NR_io_uring_setup) && defined(IORING_OFF_SQ_RING)
+#define HAVE_IO_URING 1
+#endif
+
+enum { QueueDepthMAX = 256, QueueThreadsMAX = 32 };
+
+DiskQueue::DiskQueue(SimDisk * sd, uint d)
+{
+  simDisk = sd;
+  depth = d;
+  nStarted = nPeak = 0;
+  parked = parkedTail = 0;
+}
+
+DiskQueue::~DiskQueue()
+{
+}
+
+/* post:: Wait for every started transfer to complete.  Derived
+ * destructors call this, while start()/complete() still work. */
+
+void DiskQueue::drain()
+{
+  while (reap(1) != 0)
+    ;
+}
+
+int DiskQueue::diskFd()
+{
+  return simDisk->fd;
+}
+
+void DiskQueue::countTransfer(DiskRequest * r)
+{
+  simDisk->countTransfer(r->count, r->writeFlag);
+}
+
+/* post:: Can r go to the disk as it is, without a bounce buffer? */
+
+uint DiskQueue::isAligned(DiskRequest * r)
+{
+  struct iovec iov;
+  iov.iov_base = r->p;
+  iov.iov_len = (size_t) r->count * simDisk->nBytesPerSector;
+  return simDisk->isAligned(&iov, 1);
+}
+
+/* post:: Do the transfer r synchronously, and return its result. */
+
+uint DiskQueue::transfer(DiskRequest * r)
+{
+  struct iovec iov;
+  iov.iov_base = r->p;
+  iov.iov_len = (size_t) r->count * simDisk->nBytesPerSector;
+  return simDisk->rdwrSectorsv(r->nSector, &iov, 1, r->writeFlag);
+}
+
+void DiskQueue::park(DiskRequest * r)
+{
+  r->next = 0;
+  if (parkedTail == 0)
+    parked = r;
+  else
+    parkedTail->next = r;
+  parkedTail = r;
+}
+
+uint DiskQueue::nInFlight()
+{
+  return nStarted;
+}
+
+uint DiskQueue::submit(DiskRequest * r)
+{
+  uint nsecs = simDisk->nSectorsPerDisk;
+  r->result = 0;
+  if (r->p == 0 || r->count == 0 || r->nSector >= nsecs
+      || r->count > nsecs - r->nSector) {
+    park(r);			// completes at once, having failed
+    return 0;
+  }
+  if (! isAligned(r)) {
+    r->result = transfer(r);	// via a bounce buffer, synchronously
+    park(r);
+    return 1;
+  }
+  while (nStarted >= depth) {	// make room; keep what completes
+    DiskRequest * d = complete(1);
+    if (d == 0) {
+      park(r);			// no room will come; r fails
+      return 0;
+    }
+    nStarted--;
+    park(d);
+  }
+  if (start(r) == 0) {
+    park(r);			// r->result is 0
+    return 0;
+  }
+  if (++nStarted > nPeak)
+    nPeak = nStarted;
+  return 1;
+}
+
+DiskRequest * DiskQueue::reap(uint waitFlag)
+{
+  DiskRequest * r = parked;
+  if (r != 0) {
+    parked = r->next;
+    if (parked == 0)
+      parkedTail = 0;
+    return r;
+  }
+  if (nStarted == 0)
+    return 0;
+  r = complete(waitFlag);
+  if (r != 0)
+    nStarted--;
+  return r;
+}
+
+/* ------------------------------------------------------------------ */
+
+class SyncQueue : public DiskQueue {
+public:
+  SyncQueue(SimDisk * sd) : DiskQueue(sd, 1) { done = 0; }
+  ~SyncQueue() { drain(); }
+  const char * kind() { return "sync"; }
+
+protected:
+  uint start(DiskRequest * r) {
+    r->result = transfer(r);
+    r->next = done;
+    done = r;
+    return 1;
+  }
+  DiskRequest * complete(uint waitFlag) {
+    DiskRequest * r = done;
+    if (r != 0)
+      done = r->next;
+    return r;
+  }
+
+private:
+  DiskRequest * done;
+};
+
+/* ------------------------------------------------------------------ */
+
+class ThreadQueue : public DiskQueue {
+public:
+  ThreadQueue(SimDisk * sd, uint depth);
+  ~ThreadQueue();
+  const char * kind() { return "threads"; }
+  uint isOK() { return nWorkers > 0; }
+
+protected:
+  uint start(DiskRequest * r);
+  DiskRequest * complete(uint waitFlag);
+
+private:
+  pthread_mutex_t lock;
+  pthread_cond_t haveWork, haveDone;
+  DiskRequest * todo, * todoTail;	// FIFO of not yet started
+  DiskRequest * done;		// finished, in any order
+  uint stopFlag;
+  uint nWorkers;
+  pthread_t * workers;
+
+  static void * work(void * arg);
+};
+
+ThreadQueue::ThreadQueue(SimDisk * sd, uint d) : DiskQueue(sd, d)
+{
+  pthread_mutex_init(&lock, 0);
+  pthread_cond_init(&haveWork, 0);
+  pthread_cond_init(&haveDone, 0);
+  todo = todoTail = done = 0;
+  stopFlag = 0;
+  uint n = (d < QueueThreadsMAX ? d : QueueThreadsMAX);
+  workers = new pthread_t[n];
+  for (nWorkers = 0; nWorkers < n; nWorkers++)
+    if (pthread_create(&workers[nWorkers], 0, work, this) != 0)
+      break;
+}
+
+ThreadQueue::~ThreadQueue()
+{
+  if (nWorkers > 0)
+    drain();
+  pthread_mutex_lock(&lock);
+  stopFlag = 1;
+  pthread_cond_broadcast(&haveWork);
+  pthread_mutex_unlock(&lock);
+  for (uint i = 0; i < nWorkers; i++)
+    pthread_join(workers[i], 0);
+  delete [] workers;
+  pthread_cond_destroy(&haveDone);
+  pthread_cond_destroy(&haveWork);
+  pthread_mutex_destroy(&lock);
+}
+
+void * ThreadQueue::work(void * arg)
+{
+  ThreadQueue * q = (ThreadQueue *) arg;
+  pthread_mutex_lock(&q->lock);
+  for (;;) {
+    while (q->todo == 0 && q->stopFlag == 0)
+      pthread_cond_wait(&q->haveWork, &q->lock);
+    if (q->todo == 0)
+      break;			// stopFlag, and nothing left to do
+    DiskRequest * r = q->todo;
+    q->todo = r->next;
+    if (q->todo == 0)
+      q->todoTail = 0;
+    pthread_mutex_unlock(&q->lock);
+
+    r->result = q->transfer(r);
+
+    pthread_mutex_lock(&q->lock);
+    r->next = q->done;
+    q->done = r;
+    pthread_cond_signal(&q->haveDone);
+  }
+  pthread_mutex_unlock(&q->lock);
+  return 0;
+}
+
+uint ThreadQueue::start(DiskRequest * r)
+{
+  r->next = 0;
+  pthread_mutex_lock(&lock);
+  if (todoTail == 0)
+    todo = r;
+  else
+    todoTail->next = r;
+  todoTail = r;
+  pthread_cond_signal(&haveWork);
+  pthread_mutex_unlock(&lock);
+  return 1;
+}
+
+DiskRequest * ThreadQueue::complete(uint waitFlag)
+{
+  pthread_mutex_lock(&lock);
+  while (done == 0 && waitFlag)
+    pthread_cond_wait(&haveDone, &lock);
+  DiskRequest * r = done;
+  if (r != 0)
+    done = r->next;
+  pthread_mutex_unlock(&lock);
+  return r;
+}
+
+/* ------------------------------------------------------------------ */
+
+#ifdef HAVE_IO_URING
+
+class UringQueue : public DiskQueue {
+public:
+  UringQueue(SimDisk * sd, uint depth);
+  ~UringQueue();
+  const char * kind() { return "io_uring"; }
+  uint isOK() { return ringFd >= 0; }
+
+protected:
+  uint start(DiskRequest * r);
+  DiskRequest * complete(uint waitFlag);
+
+private:
+  int ringFd;
+  void * sqRing, * cqRing;
+  size_t sqRingSz, cqRingSz;
+  struct io_uring_sqe * sqes;
+  size_t sqesSz;
+  unsigned * sqTail, * sqMask, * sqArray;
+  unsigned * cqHead, * cqTail, * cqMask;
+  struct io_uring_cqe * cqes;
+
+  DiskRequest ** slotReq;	// request of each in-flight slot
+  struct iovec * slotIov;	// its buffer, as READV/WRITEV want it
+  uint * freeSlots;		// stack of unused slot numbers
+  uint nFreeSlots;
+
+  void unmap();
+};
+
+static int uringEnter(int fd, uint toSubmit, uint minComplete, uint flags)
+{
+  return syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags,
+		 (void *) 0, (size_t) 0);
+}
+
+UringQueue::UringQueue(SimDisk * sd, uint d) : DiskQueue(sd, d)
+{
+  sqRing = cqRing = MAP_FAILED;
+  sqes = (struct io_uring_sqe *) MAP_FAILED;
+  slotReq = 0;
+  slotIov = 0;
+  freeSlots = 0;
+
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  ringFd = syscall(__NR_io_uring_setup, d, &p);
+  if (ringFd < 0)
+    return;
+
+  sqRingSz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  cqRingSz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  uint single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+  if (single) {
+    if (cqRingSz > sqRingSz)
+      sqRingSz = cqRingSz;
+    cqRingSz = sqRingSz;
+  }
+  sqRing = mmap(0, sqRingSz, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+  cqRing = (single ? sqRing
+	    : mmap(0, cqRingSz, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING));
+  sqesSz = p.sq_entries * sizeof(struct io_uring_sqe);
+  sqes = (struct io_uring_sqe *)
+    mmap(0, sqesSz, PROT_READ | PROT_WRITE,
+	 MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+  if (sqRing == MAP_FAILED || cqRing == MAP_FAILED || sqes == MAP_FAILED) {
+    unmap();
+    return;
+  }
+
+  byte * sq = (byte *) sqRing, * cq = (byte *) cqRing;
+  sqTail = (unsigned *) (sq + p.sq_off.tail);
+  sqMask = (unsigned *) (sq + p.sq_off.ring_mask);
+  sqArray = (unsigned *) (sq + p.sq_off.array);
+  cqHead = (unsigned *) (cq + p.cq_off.head);
+  cqTail = (unsigned *) (cq + p.cq_off.tail);
+  cqMask = (unsigned *) (cq + p.cq_off.ring_mask);
+  cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+  slotReq = new DiskRequest *[d];
+  slotIov = new struct iovec[d];
+  freeSlots = new uint[d];
+  for (nFreeSlots = 0; nFreeSlots < d; nFreeSlots++)
+    freeSlots[nFreeSlots] = d - 1 - nFreeSlots;
+}
+
+UringQueue::~UringQueue()
+{
+  if (ringFd >= 0)
+    drain();
+  unmap();
+  delete [] slotReq;
+  delete [] slotIov;
+  delete [] freeSlots;
+}
+
+void UringQueue::unmap()
+{
+  if (sqes != MAP_FAILED)
+    munmap(sqes, sqesSz);
+  if (cqRing != MAP_FAILED && cqRing != sqRing)
+    munmap(cqRing, cqRingSz);
+  if (sqRing != MAP_FAILED)
+    munmap(sqRing, sqRingSz);
+  sqRing = cqRing = MAP_FAILED;
+  sqes = (struct io_uring_sqe *) MAP_FAILED;
+  if (ringFd >= 0)
+    close(ringFd);
+  ringFd = -1;
+}
+
+/* pre:: a slot is free, as at most depth requests are in flight;;
+ * post:: Queue one READV/WRITEV for r and hand it to the kernel.  If
+ * the kernel will not take it, take it back out of the ring and
+ * return 0. */
+
+uint UringQueue::start(DiskRequest * r)
+{
+  uint slot = freeSlots[--nFreeSlots];
+  slotReq[slot] = r;
+  slotIov[slot].iov_base = r->p;
+  slotIov[slot].iov_len = (size_t) r->count * simDisk->nBytesPerSector;
+
+  unsigned tail = *sqTail;	// only we produce; plain read is fine
+  unsigned x = tail & *sqMask;
+  struct io_uring_sqe * sqe = &sqes[x];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = (r->writeFlag ? IORING_OP_WRITEV : IORING_OP_READV);
+  sqe->fd = diskFd();
+  sqe->off = (off_t) simDisk->nBytesPerSector * r->nSector;
+  sqe->addr = (ulong) &slotIov[slot];
+  sqe->len = 1;
+  sqe->user_data = slot;
+  sqArray[x] = x;
+  __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+
+  int n;
+  while ((n = uringEnter(ringFd, 1, 0, 0)) < 0 && errno == EINTR)
+    ;
+  if (n <= 0) {			// e.g., EAGAIN, EBUSY: not consumed
+    __atomic_store_n(sqTail, tail, __ATOMIC_RELEASE);
+    freeSlots[nFreeSlots++] = slot;
+    return 0;
+  }
+  countTransfer(r);
+  return 1;
+}
+
+DiskRequest * UringQueue::complete(uint waitFlag)
+{
+  for (;;) {
+    unsigned head = *cqHead;	// only we consume
+    if (head != __atomic_load_n(cqTail, __ATOMIC_ACQUIRE)) {
+      struct io_uring_cqe * cqe = &cqes[head & *cqMask];
+      uint slot = (uint) cqe->user_data;
+      int res = cqe->res;
+      __atomic_store_n(cqHead, head + 1, __ATOMIC_RELEASE);
+
+      DiskRequest * r = slotReq[slot];
+      freeSlots[nFreeSlots++] = slot;
+      r->result = (res > 0 && (size_t) res == slotIov[slot].iov_len
+		   ? (uint) res : 0);
+      return r;
+    }
+    if (waitFlag == 0)
+      return 0;
+    if (uringEnter(ringFd, 0, 1, IORING_ENTER_GETEVENTS) < 0
+	&& errno != EINTR)
+      return 0;
+  }
+}
+
+#endif // HAVE_IO_URING
+
+/* ------------------------------------------------------------------ */
+
+/* pre:: depth > 0;; post:: Return a new queue on simDisk, using the
+ * best backend that works here. */
+
+DiskQueue * newDiskQueue(SimDisk * simDisk, uint depth)
+{
+  if (depth > QueueDepthMAX)
+    depth = QueueDepthMAX;
+  if (depth <= 1)
+    return new SyncQueue(simDisk);
+
+#ifdef HAVE_IO_URING
+  if (simDisk->ioMode != ioModeMmap) {
+    UringQueue * uq = new UringQueue(simDisk, depth);
+    if (uq->isOK())
+      return uq;
+    delete uq;
+  }
+#endif
+  ThreadQueue * tq = new ThreadQueue(simDisk, depth);
+  if (tq->isOK())
+    return tq;
+  delete tq;
+  return new SyncQueue(simDisk);
+}
+
+// -eof-
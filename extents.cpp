@@ -0,0 +1,269 @@
+/*
+ * extents.C -- the extent format of inodes
+ */
+
+/*
+ * On a volume made with superBlock.iFormat == iFormatExtents, entries
+ * 0 .. xType-1 of an inode hold records of three uints (logical,
+ * physical, length): file blocks logical .. logical+length-1 are the
+ * disk blocks physical .. physical+length-1.  A record of length 0 is
+ * unused; the used ones come first, in logical order.  When they no
+ * longer fit, the records move into a tree block, and the inode holds
+ * index records (logical, block, length) instead, where block is a
+ * tree block of records one level down that together map length file
+ * blocks from logical on.  The depth of this extent tree, 0 while the
+ * extents fit in the inode, is kept in the type field above
+ * iTypeMASK.  A file only grows or shrinks at its end, so it is always
+ * the rightmost path of the tree that changes.
+ */
+
+#include "fs33types.hpp"
+
+#define xType (fv->superBlock.iHeight - 2)
+#define xFileSize (fv->superBlock.iHeight - 1)
+
+enum {xLogical = 0, xPhysical = 1, xLength = 2, ExtentUINTS = 3};
+
+#define rootCap (xType / ExtentUINTS)
+#define blockCap \
+  (fv->superBlock.nBytesPerBlock / fv->superBlock.iWidth / ExtentUINTS)
+#define depthOf(pin) ((pin)[xType] >> iDepthSHIFT)
+
+/* pre:: recs[] has room for cap records;; post:: Return the number of
+ * records in use. */
+
+uint Inodes::extCount(uint * recs, uint cap)
+{
+  uint n = 0;
+  while (n < cap && recs[n * ExtentUINTS + xLength] > 0)
+    n++;
+  return n;
+}
+
+/* pre:: none;; post:: Allocate a block for the extent tree, and return
+ * its number, 0 if the volume is full.  The caller writes it.  Tree
+ * blocks are taken first fit from the beginning of the files area,
+ * away from the end of the file, where its next blocks are wanted. */
+
+uint Inodes::extNewBlock()
+{
+  uint bn = fv->superBlock.nBlockBeginFiles;
+  return (fv->fbvBlocks.allocRange(1, &bn, allocFirstFit) > 0 ? bn : 0);
+}
+
+/* pre:: pin points to a cached inode;; post:: Return the block number
+ * of file block nth, 0 if there is none.  If nLeft != 0, set *nLeft to
+ * the number of blocks of its extent from nth on. */
+
+uint Inodes::extFind(uint * pin, uint nth, uint * nLeft)
+{
+  uint depth = depthOf(pin), cap = rootCap, * recs = pin, bn = 0;
+  uint * ib = 0;
+
+  for (;;) {
+    uint n = extCount(recs, cap), i = 0;
+    while (i < n && nth >= recs[i * ExtentUINTS + xLogical]
+	   + recs[i * ExtentUINTS + xLength])
+      i++;
+    uint * r = recs + i * ExtentUINTS;
+    if (i == n || nth < r[xLogical])
+      break;
+    if (depth == 0) {
+      bn = r[xPhysical] + (nth - r[xLogical]);
+      if (nLeft != 0)
+	*nLeft = r[xLength] - (nth - r[xLogical]);
+      break;
+    }
+    if (ib == 0)
+      ib = (uint *) alignedAlloc(fv->superBlock.nBytesPerBlock);
+    fv->readBlock(r[xPhysical], ib);
+    recs = ib;
+    cap = blockCap;
+    depth--;
+  }
+  if (ib) alignedFree(ib);
+  return bn;
+}
+
+/* pre:: pin points to a cached inode, out[] has room for count;;
+ * post:: Deposit into out[] the block numbers of file blocks first ..
+ * first+count-1, with one walk of the tree per extent.  Return the
+ * number deposited. */
+
+uint Inodes::extMap(uint * pin, uint first, uint count, uint * out)
+{
+  uint n = 0, nLeft, bn;
+  while (n < count && (bn = extFind(pin, first + n, &nLeft)) > 0)
+    for (; nLeft > 0 && n < count; nLeft--)
+      out[n++] = bn++;
+  return n;
+}
+
+/* pre:: level >= 0;; post:: Make a path of level+1 new tree blocks,
+ * the lowest holding the one extent (nu, bn, len), and return the
+ * number of the topmost, 0 if the volume is full. */
+
+uint Inodes::extNewPath(uint level, uint nu, uint bn, uint len)
+{
+  uint tb = extNewBlock(), child = bn;
+  if (tb == 0)
+    return 0;
+  if (level > 0 && (child = extNewPath(level - 1, nu, bn, len)) == 0) {
+    fv->fbvBlocks.setBit(tb, 1);
+    return 0;
+  }
+
+  uint bsz = fv->superBlock.nBytesPerBlock;
+  uint * ib = (uint *) alignedAlloc(bsz);
+  memset(ib, 0, bsz);
+  ib[xLogical] = nu;
+  ib[xPhysical] = child;
+  ib[xLength] = len;
+  fv->writeBlock(tb, ib);
+  alignedFree(ib);
+  return tb;
+}
+
+/* pre:: recs[] holds the records, cap at most, of a node at the given
+ * depth of the tree of a file of nu blocks;; post:: Map file blocks nu
+ * .. nu+len-1 to bn .. bn+len-1 under this node, by lengthening its
+ * last extent if they continue it.  Return 0 if this node, and its
+ * rightmost path, is full, 1 otherwise. */
+
+uint Inodes::extAppend(uint * recs, uint cap, uint depth,
+		       uint nu, uint bn, uint len)
+{
+  uint n = extCount(recs, cap);
+  if (n > 0) {
+    uint * r = recs + (n - 1) * ExtentUINTS;
+    if (depth == 0) {
+      if (r[xPhysical] + r[xLength] == bn && r[xLogical] + r[xLength] == nu) {
+	r[xLength] += len;
+	return 1;
+      }
+    } else {
+      uint * ib = (uint *) alignedAlloc(fv->superBlock.nBytesPerBlock);
+      fv->readBlock(r[xPhysical], ib);
+      uint ok = extAppend(ib, blockCap, depth - 1, nu, bn, len);
+      if (ok)
+	fv->writeBlock(r[xPhysical], ib);
+      alignedFree(ib);
+      if (ok) {
+	r[xLength] += len;
+	return 1;
+      }
+    }
+  }
+  if (n == cap)
+    return 0;
+
+  uint child = bn;
+  if (depth > 0 && (child = extNewPath(depth - 1, nu, bn, len)) == 0)
+    return 0;
+  uint * r = recs + n * ExtentUINTS;
+  r[xLogical] = nu;
+  r[xPhysical] = child;
+  r[xLength] = len;
+  return 1;
+}
+
+/* pre:: pin points to a cached inode that maps nu blocks;; post:: Map
+ * its blocks nu .. nu+len-1 to bn .. bn+len-1.  Should the records in
+ * the inode be full, they move down into a new tree block and the tree
+ * grows a level.  Return 1 if done, 0 if the volume is full. */
+
+uint Inodes::extAddRun(uint * pin, uint nu, uint bn, uint len)
+{
+  uint depth = depthOf(pin);
+  if (extAppend(pin, rootCap, depth, nu, bn, len))
+    return 1;
+
+  uint tb = extNewBlock(), bsz = fv->superBlock.nBytesPerBlock;
+  if (tb == 0)
+    return 0;
+  uint * ib = (uint *) alignedAlloc(bsz);
+  memset(ib, 0, bsz);
+  memcpy(ib, pin, rootCap * ExtentUINTS * fv->superBlock.iWidth);
+  fv->writeBlock(tb, ib);
+  alignedFree(ib);
+
+  memset(pin, 0, xType * fv->superBlock.iWidth);
+  pin[xLogical] = 0;
+  pin[xPhysical] = tb;
+  pin[xLength] = nu;
+  pin[xType] += 1 << iDepthSHIFT;
+  return extAppend(pin, rootCap, depth + 1, nu, bn, len);
+}
+
+/* pre:: recs[] holds the records, cap at most, of a node at the given
+ * depth;; post:: Release the last file block under this node, and the
+ * tree blocks that it leaves empty.  Return 2 as setBlockNumber()
+ * does, 0 if there was no block. */
+
+uint Inodes::extRelease(uint * recs, uint cap, uint depth)
+{
+  uint n = extCount(recs, cap);
+  if (n == 0)
+    return 0;
+
+  uint * r = recs + (n - 1) * ExtentUINTS;
+  if (depth == 0)
+    fv->fbvBlocks.setBit(r[xPhysical] + r[xLength] - 1, 1);
+  else {
+    uint * ib = (uint *) alignedAlloc(fv->superBlock.nBytesPerBlock);
+    fv->readBlock(r[xPhysical], ib);
+    extRelease(ib, blockCap, depth - 1);
+    if (r[xLength] > 1)
+      fv->writeBlock(r[xPhysical], ib);
+    else
+      fv->fbvBlocks.setBit(r[xPhysical], 1);	// empty
+    alignedFree(ib);
+  }
+  if (--r[xLength] == 0)
+    r[xLogical] = r[xPhysical] = 0;
+  return 2;
+}
+
+/* pre:: pin points to a cached inode;; post:: Release its last block,
+ * and if the file is left empty, the depth of its tree goes back to
+ * 0.  Return as setBlockNumber() does. */
+
+uint Inodes::extReleaseLast(uint * pin)
+{
+  uint changed = extRelease(pin, rootCap, depthOf(pin));
+  if (extCount(pin, rootCap) == 0)
+    pin[xType] &= (1 << iDepthSHIFT) - 1;
+  return changed;
+}
+
+/* pre:: recs[] holds the records, cap at most, of a node at the given
+ * depth;; post:: Release every block under this node, an extent at a
+ * time, and the tree blocks below it. */
+
+void Inodes::extFreeTree(uint * recs, uint cap, uint depth)
+{
+  uint n = extCount(recs, cap), * ib = 0;
+  for (uint i = 0; i < n; i++) {
+    uint * r = recs + i * ExtentUINTS;
+    if (depth == 0) {
+      fv->fbvBlocks.freeRange(r[xPhysical], r[xLength]);
+      continue;
+    }
+    if (ib == 0)
+      ib = (uint *) alignedAlloc(fv->superBlock.nBytesPerBlock);
+    fv->readBlock(r[xPhysical], ib);
+    extFreeTree(ib, blockCap, depth - 1);
+    fv->fbvBlocks.setBit(r[xPhysical], 1);
+  }
+  if (ib) alignedFree(ib);
+}
+
+/* pre:: pin points to a cached inode;; post:: Release every block of
+ * its file, and its extent tree. */
+
+void Inodes::extFree(uint * pin)
+{
+  extFreeTree(pin, rootCap, depthOf(pin));
+}
+
+// -eof-
@@ -14,43 +14,166 @@ File::File(FileVolume * pfv, uint in)
 {
   fv = pfv;
   nInode = (in > 0 ? in : fv->inodes.getFree());
+  fv->inodes.pinInode(nInode);
   bsz = fv->superBlock.nBytesPerBlock;
 
   // Caution: In mid-read-byte-by-byte do not do readBlock or writeBlock
   // directly.
-  fileBuf = new byte[bsz];
+  fileBuf = (byte *) alignedAlloc(bsz);
   nBlocksSoFar = 0;
   nBytesInFileBuf = 0;
   xNextByte = 0;
+  raBuf = 0;
+  raFirst = raCount = raWindow = raNext = 0;
+  bmap = 0;
+  bmFirst = bmCount = bmEpoch = 0;
 }
 
 
 File::~File()
 {
-  delete fileBuf;
+  fv->inodes.unpinInode(nInode);
+  alignedFree(fileBuf);
+  if (raBuf) alignedFree(raBuf);
+  delete [] bmap;
+}
+
+/* pre:: none;; post:: Return the block number of block nx of this
+ * file, 0 if there is none.  The numbers come from bmap[], which is
+ * refilled, when nx is not in it, with the block numbers of a block of
+ * pointers' worth of blocks from nx on, so a sequential reader reads
+ * each indirect block about once.  Blocks only ever leave a file at its end, but
+ * a File may not be the only one open on its inode, so bmap[] is also
+ * refilled once any block has left any file. */
+
+uint File::blockNumber(uint nx)
+{
+  if (nx >= bmFirst && nx < bmFirst + bmCount
+      && bmEpoch == fv->inodes.mapEpoch)
+    return bmap[nx - bmFirst];
+
+  uint bnpb = bsz / fv->superBlock.iWidth;
+  if (bmap == 0)
+    bmap = new uint[bnpb];
+  bmFirst = nx;
+  bmEpoch = fv->inodes.mapEpoch;
+  bmCount = fv->inodes.getBlockNumbers(nInode, nx, bnpb, bmap, 0);
+  return (bmCount > 0 ? bmap[0] : 0);
+}
+
+/* pre:: raWindow >= 2, block nx is in this file;; post:: Read blocks
+ * nx .. nx+raWindow-1 of this file, those that exist, into raBuf[].
+ * Runs of adjacent block numbers are one transfer each, and all of
+ * them are on the disk queue together.  Return the number of blocks
+ * read, 0 on failure or if fewer than two blocks remain; a lone block
+ * is better read through the block cache. */
+
+uint File::readAhead(uint nx)
+{
+  uint nBlocks = (fv->inodes.getFileSize(nInode) + bsz - 1) / bsz;
+  uint w = (raWindow < nBlocks - nx ? raWindow : nBlocks - nx), j;
+  uint bns[ReadAheadMAX];
+
+  if (w < 2)
+    return 0;
+  if (raBuf == 0)
+    raBuf = (byte *) alignedAlloc(ReadAheadMAX * bsz);
+  for (j = 0; j < w && (bns[j] = blockNumber(nx + j));
+       j++)
+    ;
+  raCount = 0;
+  fv->queueRuns(bns, j, raBuf, 0);
+  if (j == 0 || fv->drainBlocks() != j * bsz)
+    return 0;
+  raFirst = nx;
+  raCount = j;
+  return j;
 }
 
 /* pre:: bp[] is at least nBytesPerBlock long;; post:: Deposit into
  * bp[] the content of nx-th block of file.  Return the number of
- * bytes so deposited that belong to this file. */
+ * bytes so deposited that belong to this file.  A reader that asks
+ * for the blocks in order is served from raBuf[], refilled with a
+ * window of blocks that doubles on each refill up to ReadAheadMAX;
+ * any other access shrinks the window back to nothing. */
 
 uint File::readBlock(uint nx, void * bp)
 {
-  uint bn = fv->inodes.getBlockNumber(nInode, nx);
-  if (bn == 0) return 0;	// !(0 <= nx < blocks in this file)
+  uint fileSize = fv->inodes.getFileSize(nInode);
+  if (nx >= (fileSize + bsz - 1) / bsz)
+    return 0;			// !(0 <= nx < blocks in this file)
+  if (fv->inodes.isInline(nInode)) {
+    memset(bp, 0, bsz);
+    return fv->inodes.getInline(nInode, (byte *) bp);
+  }
 
-  fv->readBlock(bn, bp);
+  if (nx < raFirst || nx >= raFirst + raCount) {
+    if (nx != raNext)
+      raWindow = 0;
+    else
+      raWindow = (raWindow == 0 ? 2 : raWindow < ReadAheadMAX / 2
+		  ? 2 * raWindow : ReadAheadMAX);
+    if (raWindow < 2 || readAhead(nx) == 0) {
+      raCount = 0;
+      uint bn = blockNumber(nx);
+      if (bn == 0) return 0;
+      fv->readBlock(bn, bp);
+    }
+  }
+  if (nx >= raFirst && nx < raFirst + raCount)
+    memcpy(bp, raBuf + (nx - raFirst) * bsz, bsz);
+  raNext = nx + 1;
 
-  uint nb = fv->inodes.getFileSize(nInode) - nx * bsz;
+  uint nb = fileSize - nx * bsz;
   if (nb > bsz) nb = bsz;
   return nb;
 }
 
+/* pre:: p[] is count * bsz long;; post:: Deposit into p[] blocks nx
+ * .. nx+count-1 of this file, those that exist, bypassing the
+ * read-ahead.  Their block numbers are looked up together, and each
+ * run of adjacent ones is read with one transfer.  Return the number
+ * of bytes so deposited that belong to this file. */
+
+uint File::readBlocks(uint nx, uint count, void * p)
+{
+  uint fileSize = fv->inodes.getFileSize(nInode);
+  if (count == 0 || nx >= (fileSize + bsz - 1) / bsz)
+    return 0;
+  if (fv->inodes.isInline(nInode))
+    return readBlock(nx, p);
+
+  uint * bns = new uint[count], nRuns, nb = 0;
+  uint n = fv->inodes.getBlockNumbers(nInode, nx, count, bns, &nRuns);
+  if (n == 1)
+    nb = fv->readBlock(bns[0], p);	// a lone block may well be cached
+  else if (nRuns == 1)
+    nb = fv->readBlocks(bns[0], n, p);
+  else if (n > 0) {
+    fv->queueRuns(bns, n, (byte *) p, 0);
+    nb = fv->drainBlocks();
+  }
+  delete [] bns;
+  if (nb != n * bsz)
+    return 0;
+  return (nb < fileSize - nx * bsz ? nb : fileSize - nx * bsz);
+}
+
 uint File::writeBlock(uint nBlock, void * p)
 {
-  uint bn = fv->inodes.getBlockNumber(nInode, nBlock);
+  uint fileSize = fv->inodes.getFileSize(nInode);
+  if (nBlock == 0 && fileSize > 0 && fv->inodes.isInline(nInode)) {
+    fv->inodes.setInline(nInode, (byte *) p, fileSize);
+    return bsz;
+  }
+
+  uint nBlocks = (fileSize + bsz - 1) / bsz;
+  uint bn = (nBlock < nBlocks ? blockNumber(nBlock) : 0);
   if (bn == 0) return 0;
 
+  if (nBlock >= raFirst && nBlock < raFirst + raCount)
+    raCount = 0;		// read-ahead copy is stale
+
   return fv->writeBlock(bn, p);
 }
 
@@ -60,19 +183,88 @@ uint File::writeBlock(uint nBlock, void * p)
 
 uint File::appendOneBlock(void * p, uint iz)
 {
-  uint bn = fv->getFreeBlock();
-  if (bn == 0) iz = 0;
-  else {
-    memcpy(fileBuf, p, iz);
-    fv->writeBlock(bn, fileBuf);
-    fv->inodes.addBlockNumber(nInode, bn);
-    fv->inodes.incFileSize(nInode, iz);
+  return appendBlocks((byte *) p, iz);
+}
+
+/* pre:: file size is a multiple of bsz, nBytes > 0;; post:: Append
+ * content[0..nBytes-1] as new blocks at the end of this file.  The
+ * blocks are allocated together, as contiguous runs that preferably
+ * continue from the current last block, written with one transfer per
+ * run, and then entered into the inode with one inode write.  Only
+ * the last block, if partial, is copied (to pad it with zeros).  An
+ * empty file given no more than Inodes::inlineMax() bytes keeps them
+ * inline instead.  Return the number of bytes appended. */
+
+uint File::appendBlocks(byte * content, uint nBytes)
+{
+  uint fileSize = fv->inodes.getFileSize(nInode);
+  if (fileSize == 0 && nBytes <= fv->inodes.inlineMax())
+    return fv->inodes.setInline(nInode, content, nBytes);
+  if (fv->inodes.isInline(nInode))
+    return 0;			// see fillLastBlock()
+
+  uint n = (nBytes + bsz - 1) / bsz, nFull = nBytes / bsz, j, k, len;
+  uint * bns = new uint[n];
+  uint nu = fileSize / bsz;
+  uint goal = (nu > 0 ? blockNumber(nu - 1) + 1 : 0);
+
+  for (j = 0; j < n; goal += len) {
+    if ((len = fv->fbvBlocks.allocRange(n - j, &goal, allocFirstFit)) == 0)
+      break;
+    for (uint i = 0; i < len; i++)
+      bns[j++] = goal + i;
+  }
+  if (j < n)
+    nBytes = j * bsz;		// volume is full
+  if (nFull > j)
+    nFull = j;
+  fv->queueRuns(bns, nFull, content, 1);
+  if (nFull < j) {
+    memset(fileBuf, 0, bsz);
+    memcpy(fileBuf, content + nFull * bsz, nBytes - nFull * bsz);
+    fv->queueBlocks(bns[nFull], 1, fileBuf, 1);
   }
-  return iz;
+  k = (fv->drainBlocks() == j * bsz
+       ? fv->inodes.addBlockNumbers(nInode, bns, j, nBytes) : 0);
+  for (uint i = k; i < j; i++)
+    fv->fbvBlocks.setBit(bns[i], 1);	// not in the file after all
+  delete [] bns;
+  return (k < j ? k * bsz : nBytes);
+}
+
+/* pre:: this file is inline;; post:: Append newContentBp[0..nBytes-1]
+ * inline if it still fits.  Otherwise move the content to a block of
+ * its own, and append nothing.  Return the number of bytes appended. */
+
+uint File::fillInline(byte * newContentBp, uint nBytes)
+{
+  uint fileSize = fv->inodes.getFileSize(nInode);
+  memset(fileBuf, 0, bsz);
+  fv->inodes.getInline(nInode, fileBuf);
+  if (fileSize + nBytes <= fv->inodes.inlineMax()) {
+    memcpy(fileBuf + fileSize, newContentBp, nBytes);
+    return fv->inodes.setInline(nInode, fileBuf, fileSize + nBytes) - fileSize;
+  }
+
+  uint bn = 0;
+  if (fileSize > 0 && fv->fbvBlocks.allocRange(1, &bn, allocFirstFit) == 0)
+    return 0;			// volume is full
+  if (bn > 0)
+    fv->writeBlock(bn, fileBuf);
+  if (fv->inodes.clearInline(nInode, bn) == 0)
+    fv->fbvBlocks.setBit(bn, 1);
+  bmCount = 0;
+  return 0;
 }
 
 uint File::fillLastBlock(byte * newContentBp, uint nBytes)
 {
+  if (fv->inodes.isInline(nInode)) {
+    uint nb = fillInline(newContentBp, nBytes);
+    if (nb > 0 || fv->inodes.isInline(nInode))
+      return nb;
+  }
+
   uint fileSize = fv->inodes.getFileSize(nInode);
   uint nFragmentSize = fileSize % bsz;
   if (nFragmentSize == 0) return 0;
@@ -103,8 +295,9 @@ uint File::appendBytes(byte * content, uint nBytes)
     nBytes -= nb;
     if (nBytes == 0)
       break;
-    nb = (nBytes > bsz ? bsz : nBytes);
-    appendOneBlock(content, nb);
+    nb = (nBytes > AppendMAX * bsz ? AppendMAX * bsz : nBytes);
+    if ((nb = appendBlocks(content, nb)) == 0)
+      break;			// volume or inode is full
   }
   return nWritten;
 }
@@ -121,37 +314,46 @@ uint File::getNextByte()
   return (xNextByte < nBytesInFileBuf? fileBuf[xNextByte++] : 0);
 }
 
-/* pre:: nBlocksSoFar >= 1, bsz >= nBytes > 0;; post:: Delete nBytes
- * from the file preceding the current position (fromx);; Caution: May
- * cross over block boundaries. NB: Only caller: Directory::
- * deleteFile().  */
+/* pre:: none;; post:: Make byte x of this file the one that
+ * getNextByte() returns next. */
 
-uint File::deletePrecedingBytes(uint nBytes)
+void File::seekByte(uint x)
 {
-  uint fromx = (nBlocksSoFar - 1) * bsz + xNextByte;
-  uint fileSize = fv->inodes.getFileSize(nInode);
-  uint nBytesToShiftLeft = fileSize - fromx;
-  if (fromx < nBytes) nBytes = fromx;
-  uint tox = fromx - nBytes;	// byte index relative to file
-  uint toBlockx = tox % bsz;	// byte index relative to localBuf
-  uint toBlockNum = tox / bsz;
-  byte * localBuf = new byte[bsz];
-
-  readBlock(toBlockNum, localBuf);
-  while (nBytesToShiftLeft-- > 0) {
-    localBuf[toBlockx++] = getNextByte();
-    if (toBlockx == bsz) {
-      writeBlock(toBlockNum++, localBuf);
-      toBlockx = 0;
-    }
-  }
-  if (toBlockx > 0) writeBlock(toBlockNum, localBuf);
-  if (fileSize % bsz == nBytes) {
-    fv->inodes.setLastBlockNumber(nInode, 0); // free last block
+  nBlocksSoFar = x / bsz;
+  nBytesInFileBuf = readBlock(nBlocksSoFar++, fileBuf);
+  xNextByte = (x % bsz < nBytesInFileBuf ? x % bsz : nBytesInFileBuf);
+}
+
+/* pre:: none;; post:: Return the offset of the byte that
+ * getNextByte() returns next. */
+
+uint File::tellByte()
+{
+  return (nBlocksSoFar > 0 ? (nBlocksSoFar - 1) * bsz + xNextByte : 0);
+}
+
+/* pre:: x + n <= file size;; post:: Overwrite bytes x .. x+n-1 of this
+ * file with p[0..n-1], a block at a time; they may cross block
+ * boundaries.  Return the number of bytes written. */
+
+uint File::writeBytes(uint x, byte * p, uint n)
+{
+  byte * buf = (byte *) alignedAlloc(bsz);
+  uint nw = 0;
+  while (nw < n) {
+    uint k = (x + nw) / bsz, y = (x + nw) % bsz;
+    uint m = (bsz - y < n - nw ? bsz - y : n - nw);
+    if (readBlock(k, buf) < y + m)
+      break;
+    memcpy(buf + y, p + nw, m);
+    if (writeBlock(k, buf) == 0)
+      break;
+    if (k + 1 == nBlocksSoFar)
+      memcpy(fileBuf, buf, nBytesInFileBuf);	// keep getNextByte() current
+    nw += m;
   }
-  fv->inodes.setFileSize(nInode, fileSize - nBytes);
-  delete localBuf;
-  return nBytes;
+  alignedFree(buf);
+  return nw;
 }
 
 // -eof-
@@ -9,13 +9,18 @@
 #include <stdlib.h>
 #include <fcntl.h>
 #include <sys/wait.h>
+#include <pthread.h>
 
 typedef unsigned char byte;
 typedef unsigned short int ushort;
 typedef unsigned int uint;
 typedef unsigned long int ulong;
 
-enum { LabelSZ = 15, SectorsMAX = 2048, BytesPerSectorMAX = 4096 };
+struct iovec;			// see <sys/uio.h>
+
+// SectorsMAX * BytesPerSectorMAX can exceed 4 GiB: byte offsets into
+// a disk image are 64-bit off_t, never uint.
+enum { LabelSZ = 15, SectorsMAX = 1 << 30, BytesPerSectorMAX = 1 << 16 };
 
 uint TODO();
 uint TODO(char * p);
@@ -23,8 +28,29 @@ uint bytesNeeded(uint);
 ulong unpackNumber(void * p, uint width);
 void * packNumber(void * p, ulong n, uint width);
 uint isAlphaNumDot(char c);
+uint hashName(byte * nm);
+uint entryINumber(byte * e, uint iWidth);
+void * alignedAlloc(uint nBytes);
+void alignedFree(void * p);
 
 class FileVolume;		// forward declaration
+class SimDisk;
+class DiskQueue;
+
+// How a SimDisk reaches its disk image; the ioMode column of diskParams.dat
+enum {ioModePread = 0, ioModeMmap = 1, ioModeDirect = 2};
+
+class DiskRequest {		// one sector transfer queued on a SimDisk
+public:
+  uint nSector;			// first sector
+  uint count;			// #sectors
+  void * p;			// count * nBytesPerSector bytes
+  uint writeFlag;
+  uint result;			// #bytes transferred, 0 on failure
+  DiskRequest * next;		// owned by the queue while in flight
+};
+
+DiskQueue * newDiskQueue(SimDisk * simDisk, uint depth);
 
 class SimDisk {
 public:
@@ -32,22 +58,83 @@ public:
   uint nSectorsPerDisk;
   uint nBytesPerSector;
   uint simDiskNum;
+  uint ioMode;			// ioModePread, ioModeMmap, or ioModeDirect
+  ulong nReads, nWrites;	// #read/write transfers issued so far
+  ulong nSecRead, nSecWritten;	// #sectors moved by those transfers
 
   SimDisk(byte * simDiskName, uint diskNumber);
+  ~SimDisk();
   uint isOK();
   uint writeSector(uint nSector, void * p);
   uint readSector(uint nSector, void * p);
+  uint writeSectors(uint nSector, uint count, void * p);
+  uint readSectors(uint nSector, uint count, void * p);
+  uint writeSectorsv(uint nSector, struct iovec * iov, uint iovcnt);
+  uint readSectorsv(uint nSector, struct iovec * iov, uint iovcnt);
+  uint flush();
+  uint setQueueDepth(uint depth);
+  DiskQueue * getQueue();
+  uint submit(DiskRequest * r);
+  DiskRequest * reap(uint waitFlag);
   FileVolume * make33fv(uint nInodes, uint htInode, uint nSecPerBlock);
+  FileVolume * make33fv(uint nInodes, uint htInode, uint nSecPerBlock,
+			uint iFormat, uint dFormat);
   FileVolume * make33fv();
 
-private:
-  int makeDiskImage();
-  int openDiskImage(uint mode);
-
   class DiskParams {
   public:
     uint maxfnm, nInodes, iHeight;
   } diskParams;
+
+private:
+  int fd;			// open on <name>.dsk for our lifetime
+  byte * image;			// whole of <name>.dsk, if ioModeMmap
+  DiskQueue * queue;		// for submit() and reap()
+
+  int makeDiskImage();
+  int openDiskImage(uint mode);
+  void countTransfer(ulong nSectors, uint writeFlag);
+  uint isAligned(struct iovec * iov, uint iovcnt);
+  uint rdwrSectorsv(uint nSector, struct iovec * iov, uint iovcnt,
+		    uint writeFlag);
+
+  friend class DiskQueue;
+};
+
+/* A submission/completion queue of DiskRequests on one SimDisk.
+ * submit() starts a transfer, blocking only while depth of them are
+ * already in flight; reap() hands back finished ones.  The backends
+ * (io_uring, worker threads, synchronous) are in diskqueue.cpp. */
+
+class DiskQueue {
+public:
+  uint depth;			// max #requests in flight
+  uint nPeak;			// most ever in flight at once
+
+  virtual ~DiskQueue();
+  virtual const char * kind() = 0;
+  uint submit(DiskRequest * r);
+  DiskRequest * reap(uint waitFlag);
+  uint nInFlight();
+
+protected:
+  SimDisk * simDisk;
+
+  DiskQueue(SimDisk * simDisk, uint depth);
+  void drain();
+  int diskFd();
+  uint isAligned(DiskRequest * r);
+  void countTransfer(DiskRequest * r);
+  uint transfer(DiskRequest * r);
+  virtual uint start(DiskRequest * r) = 0;	// 0: could not
+  virtual DiskRequest * complete(uint waitFlag) = 0;
+
+private:
+  uint nStarted;		// #started, not yet completed
+  DiskRequest * parked;		// completed, not yet reaped
+  DiskRequest * parkedTail;
+
+  void park(DiskRequest * r);
 };
 
 class SuperBlock {		// RAM resident
@@ -68,57 +155,171 @@ public:
 
   uint nBlockBeginFiles;	// == nBlockBeginInodes + nBlocksInode  
   uint fileNameLengthMax;
+  uint iFormat;			// iFormatBlockMap or iFormatExtents
+  uint dFormat;			// dFormatStream or dFormatStride
 };
 
+// How an inode maps its blocks: block numbers plus single, double and
+// triple indirect blocks, or (logical, physical, length) extents
+enum {iFormatBlockMap = 0, iFormatExtents = 1};
+
+// How a directory lays out its entries: NUL-terminated names each
+// followed by an i-number, or fixed-stride records (see dirstride.cpp)
+enum {dFormatStream = 0, dFormatStride = 1};
+
+enum {allocFirstFit = 0, allocBestFit = 1};
+
 class BitVector {
 public:
+  ulong nAllocs, nWords;	// allocations; summary and vector words they read
+
+  BitVector();
+  ~BitVector();
   uint create(FileVolume * fv, uint nBits, uint nBeginBlock);
   uint reCreate(FileVolume * fv, uint nBits, uint nBeginBlock);
   uint getBit(uint indexOfBit);
   void setBit(uint indexOfBit, uint newValue);
+  void setBits(uint indexOfBit, uint nBits, uint newValue);
   uint getFreeBit();
+  uint allocRange(uint n, uint * start, uint policy);
+  void freeRange(uint indexOfBit, uint n);
+  uint countFree();
+  uint selfCheck(uint nOps, uint seed);
+  uint sync();
+  uint reload();
 
 private:
   uint nBits;			// #bits in this vector
   uint nBlockBegin;		// at what block does the vector begin?
-  byte *bitVector;		// ptr to one block-long area of mem
+  uint nBlocks;			// #blocks it occupies
+  byte *bitVector;		// all of it, nBlocks blocks of mem
+  byte *dirty;			// dirty[k] != 0: block k needs writing
+  uint nChunks;			// summary: see bitvector.cpp
+  uint * nFree;			// #free bits in each chunk
+  ulong * anyFree;		// bit c: chunk c has a free bit
+  uint nGroups;			// allocation groups
+  uint groupBits;		// #bits in each, a multiple of chunk size
+  pthread_mutex_t * locks;	// one per group
+  uint * hints;			// where getFreeBit() looks, per group
   FileVolume * fv;
+
+  uint allocate(FileVolume * fv, uint nBits, uint nBeginBlock);
+  void touch(uint x);
+  void putBit(uint x, uint value);
+  void setBitLocked(uint x, uint value);
+  void setBitsLocked(uint x, uint n, uint value);
+  uint groupOf(uint x);
+  uint homeGroup();
+  uint allocIn(uint g, uint n, uint goal, uint policy,
+	       uint * start, uint minLen);
+  ulong word(uint xWord);
+  void summarize(uint chunkBegin, uint chunkEnd);
+  void markChunk(uint c);
+  uint findBit(uint x, uint endBit, uint value);
+  uint nextFreeChunk(uint c);
+  uint checkSummary();
 };
 
 enum {iTypeOrdinary = 1,  iTypeDirectory = 2, iTypeSoftLink = 3};
+enum {iTypeMASK = 0xff, iDepthSHIFT = 16};	// depth of an extent tree
+enum {iInlineFLAG = 0x100};	// content is in the inode, see Inodes::setInline
+
+enum {InodeCacheSZ = 128};	// inodes
 
 class Inodes {
 public:
+  ulong nHits, nMisses, nWriteBacks;	// of the inode cache
+  uint mapEpoch;		// bumped whenever a block leaves a file
+
+  Inodes();
+  ~Inodes();
   uint create(FileVolume * fv, uint nBegin, uint nInodes, uint htInode);
   uint reCreate(FileVolume * fv);	// in == i-node number
+  uint * pinInode(uint in);
+  void unpinInode(uint in);
+  uint sync();
+  void discard();
   uint getFree();
   uint setFree(uint in);
   uint getBlockNumber(uint in, uint nth);
+  uint getBlockNumbers(uint in, uint first, uint count, uint * out,
+			uint * nRuns);
   uint addBlockNumber(uint in, uint bn);
+  uint addBlockNumbers(uint in, uint * bns, uint n, uint nBytes);
   uint setLastBlockNumber(uint in, uint bn);
   uint getFileSize(uint in);
   uint setFileSize(uint in, uint sz);
   uint incFileSize(uint in, int increment);
   uint getType(uint in);
+  void getTypesAndSizes(uint * ins, uint n, uint * types, uint * sizes);
   uint setType(uint in, uint value);
+  uint isInline(uint in);
+  uint inlineMax();
+  uint getInline(uint in, byte * p);
+  uint setInline(uint in, byte * p, uint size);
+  uint clearInline(uint in, uint bn);
   uint show(uint in);
 
 private:
+  class Slot {			// of the inode cache
+  public:
+    uint in;			// 0 if unused
+    uint * pin;			// iHeight uints, the inode itself
+    uint refs;			// pins; a pinned slot is not reused
+    uint dirty;
+    uint hnext;			// hash chain
+    uint prev, next;		// LRU list; prev is toward the MRU end
+  };
+
   uint * uintbuffer;		// inodes from one block
   FileVolume * fv;
+  Slot * slots;
+  uint nSlots;			// InodeCacheSZ, more if all are pinned
+  uint * hash;			// heads of hash chains, by i-number
+  uint mru, lru;
 
   uint *getInode(uint in, uint * ne);	// return ptr to inode in
   uint putInode(uint in);
+  void initCache();
+  void freeCache();
+  uint findSlot(uint in);
+  void hashRemove(uint x);
+  void unlinkSlot(uint x);
+  void pushSlot(uint x, uint mruFlag);
+  uint loadSlot(uint in);
+  uint readSlot(uint x);
+  uint growCache();
+  void writeInodeBlock(uint nblock);
   uint getEntry(uint in, uint x);
   uint setEntry(uint in, uint x, uint tp);
+  uint setBlockNumber(uint * pin, uint nu, uint bn);
+  void gatherBlocks(uint bn, uint level, uint * nLeft,
+		    uint * bns, uint * nbns);
   uint getBlockNumberTripleIndirect(uint bn, uint nth);
   uint getBlockNumberDoubleIndirect(uint bn, uint nth);
   uint getBlockNumberSingleIndirect(uint bn, uint nth);
   uint setSingleIndirect(uint * pbn, uint nu, uint bn);
   uint setDoubleIndirect(uint * pbn, uint nu, uint bn);
   uint setTripleIndirect(uint * pbn, uint nu, uint bn);
+  uint extCount(uint * recs, uint cap);
+  uint extNewBlock();
+  uint extFind(uint * pin, uint nth, uint * nLeft);
+  uint extMap(uint * pin, uint first, uint count, uint * out);
+  uint extAppend(uint * recs, uint cap, uint depth,
+		 uint nu, uint bn, uint len);
+  uint extNewPath(uint level, uint nu, uint bn, uint len);
+  uint extAddRun(uint * pin, uint nu, uint bn, uint len);
+  uint extRelease(uint * recs, uint cap, uint depth);
+  uint extReleaseLast(uint * pin);
+  void extFreeTree(uint * recs, uint cap, uint depth);
+  void extFree(uint * pin);
+  uint getIndirect(uint bn, uint level, uint nth);
+  uint mapRange(uint bn, uint level, ulong x, uint count, uint * out);
+  uint setIndirect(uint * pbn, uint level, uint nu, uint bn);
 };
 
+enum {ReadAheadMAX = 32, AppendMAX = 256};	// blocks
+
 class File {
 public:
   uint nInode;			// inode number of this file
@@ -126,11 +327,15 @@ public:
   File(FileVolume * fv, uint nInode);
   ~File();
   uint readBlock(uint xthBlock, void * p);
+  uint readBlocks(uint xthBlock, uint count, void * p);
   uint writeBlock(uint xthBlock, void * p);
   uint getNextByte();
+  void seekByte(uint x);
+  uint tellByte();
+  uint writeBytes(uint x, byte * p, uint n);
   uint appendOneBlock(void * p, uint iz);
+  uint appendBlocks(byte * content, uint nBytes);
   uint appendBytes(byte *newContent, uint nBytes);
-  uint deletePrecedingBytes(uint howManyBytes);
 
 private:
 				// bsz is tentatively added, TBD
@@ -140,8 +345,29 @@ private:
   uint nBytesInFileBuf;
   uint xNextByte;		// index of next byte in fileBuf
   FileVolume * fv;
+  byte * raBuf;			// read-ahead blocks, 0 until needed
+  uint raFirst, raCount;	// file blocks raFirst .. +raCount-1 in raBuf
+  uint raWindow;		// blocks to read ahead; grows while sequential
+  uint raNext;			// the block a sequential reader asks next
+  uint * bmap;			// block numbers of file blocks bmFirst ..
+  uint bmFirst, bmCount;	// .. bmFirst+bmCount-1
+  uint bmEpoch;			// inodes.mapEpoch when bmap[] was filled
 
   uint fillLastBlock(byte *newContentBp, uint nBytes);
+  uint fillInline(byte *newContentBp, uint nBytes);
+  uint readAhead(uint nx);
+  uint blockNumber(uint nx);
+};
+
+// The first byte of a deleted directory entry; see Directory::deleteFile
+enum {TombBYTE = 1, CompactPERCENT = 50};
+enum {StrideBYTES = 16};	// records are multiples of it; see dirstride.cpp
+#define HiddenNAME "#hidx"	// names the index; see dirindex.cpp
+
+class DirEntryPlus {		// see Directory::readdirPlus
+public:
+  byte * name;
+  uint in, type, size;
 };
 
 class Directory {
@@ -158,16 +384,138 @@ public:
   uint deleteFile(byte * leafnm, uint releaseFlag);
   uint moveFile(uint pn, byte * leafnm);
   uint ls();
+  DirEntryPlus * readdirPlus(uint * n);
 
   FileVolume * fv;
 
 private:
   File * dirf;			// this dir viewed as a normal file
+  uint entryAt, entryLen;	// of the entry nextName() returned last
+  byte * blockBuf;		// stride format: a block of this dir,
+  uint bufBlock;		// .. which one, NIL if none
+  uint nextAt;			// .. offset of the entry to return next
+  byte * plusNames;		// names that readdirPlus() returned
 
   void namesEnd();		// done with file names
   byte * nextName();
+  void namesBegin();
+  void seekEntry(uint offset);
   uint setDirEntry(byte * name);
   uint lsPrivate(uint in, uint printfFlag);
+  uint makeRecord(byte * name, uint in, byte * rec);
+  uint placeEntry(byte * name, uint in, uint dead);
+  uint recordSize(byte * p, uint n, uint x);
+  uint deadBytes();
+  uint findTomb(uint len, uint * tombLen);
+  void compact();
+  static uint nextEntry(byte * p, uint n, uint x, uint iWidth);
+  uint recordBytes(uint len);
+  uint recordsEnd(byte * p);
+  byte * strideNextName();
+  uint strideFind(byte * leafnm);
+  uint strideAppend(byte * rec, uint len);
+  uint indexInode(uint * at);
+  uint indexFind(byte * leafnm, uint * offset);
+  void indexAdd(byte * leafnm, uint offset);
+  void indexRemove(byte * leafnm, uint offset);
+  uint indexMakeRoom();
+  void indexBuild();
+};
+
+enum {cachePolicyLRU = 0, cachePolicyARC = 1, CacheBlocksDEFAULT = 64};
+
+/* A write-back cache of whole blocks of one FileVolume, sitting under
+ * FileVolume::readBlock/writeBlock.  Eviction is LRU, or ARC (Megiddo
+ * and Modha's adaptive replacement cache). */
+
+class BlockCache {
+public:
+  uint policy;			// cachePolicyLRU, or cachePolicyARC
+  uint nSlots;			// capacity in blocks
+  ulong nHits, nMisses, nWriteBacks;
+
+  BlockCache(FileVolume * fv, uint nSlots, uint policy);
+  ~BlockCache();
+  uint read(uint nBlock, void * p);
+  uint write(uint nBlock, void * p);
+  void update(uint nBlock, uint count, void * p, uint stride);
+  uint writeBack(uint nBlock, uint count);
+  uint flush();
+  void discard();
+
+private:
+  enum {T1, T2, B1, B2, Free, nLists}; // T: have data; B: ARC ghosts
+
+  class Node {
+  public:
+    uint nBlock;
+    uint list;			// T1, T2, B1, B2, or Free
+    uint prev, next;		// within list; prev is toward the MRU end
+    uint hnext;			// hash chain
+    uint slot;			// data slot, if in T1 or T2
+    uint dirty;
+  };
+
+  FileVolume * fv;
+  uint bsz;
+  Node * nodes;			// 2 * nSlots of them
+  uint * hash;			// heads of hash chains
+  uint hashMask;
+  uint head[nLists], tail[nLists], len[nLists];
+  byte * data;			// nSlots blocks
+  uint * freeSlots;		// stack of unused data slots
+  uint nFreeSlots;
+  uint target;			// ARC's p: target length of T1
+
+  uint find(uint nBlock);
+  void hashInsert(uint x);
+  void hashRemove(uint x);
+  void unlink(uint x);
+  void pushMRU(uint list, uint x);
+  void moveTo(uint list, uint x);
+  void dropData(uint x);
+  void replace(uint inB2);
+  uint load(uint nBlock, uint fillFlag);
+};
+
+enum {DentryCacheSZ = 256, DentryNameMAX = 31};	// entries; bytes
+
+/* Directory lookups of one FileVolume, shared by all its Directory
+ * objects: (directory i-number, name) -> i-number, where i-number 0
+ * records that the name is not in that directory. */
+
+class DentryCache {
+public:
+  ulong nHits, nMisses;
+
+  DentryCache(uint nEntries);
+  ~DentryCache();
+  uint lookup(uint dir, byte * name, uint * in);
+  void enter(uint dir, byte * name, uint in);
+  void forgetDir(uint dir);
+  void discard();
+
+private:
+  class Entry {
+  public:
+    uint dir;			// i-number of the directory; 0 if unused
+    uint in;			// 0 if name is not in dir
+    uint hnext;			// hash chain
+    uint prev, next;		// LRU list; prev is toward the MRU end
+    byte name[DentryNameMAX + 1];
+  };
+
+  Entry * entries;
+  uint nEntries;
+  uint * hash;			// heads of hash chains
+  uint hashMask;
+  uint mru, lru;
+
+  uint find(uint dir, byte * name);
+  void hashRemove(uint x);
+  void unlink(uint x);
+  void push(uint x, uint mruFlag);
+  void drop(uint x);
 };
 
 class FileVolume {
@@ -178,8 +526,13 @@ public:
   BitVector fbvInodes;
   Inodes inodes;
   Directory * root;
+  BlockCache * cache;		// 0 if none
+  DentryCache * dentries;
+  uint * dirDeadBytes;		// by directory i-number; see Directory::deadBytes
+  uint * dirIndexes;		// by directory i-number; see Directory::indexInode
 
-  FileVolume(SimDisk * simDisk, uint nInodes, uint szInode, uint nSecPerBlock);
+  FileVolume(SimDisk * simDisk, uint nInodes, uint szInode, uint nSecPerBlock,
+	     uint iFormat, uint dFormat);
   FileVolume(uint diskNumber);
   ~FileVolume();
   uint isOK();
@@ -192,10 +545,25 @@ public:
   File * createFile(byte * leafnm, uint dirFlag);
   uint writeBlock(uint nBlock, void * p);
   uint readBlock(uint nBlock, void * p);
+  uint writeBlocks(uint nBlock, uint count, void * p);
+  uint readBlocks(uint nBlock, uint count, void * p);
+  uint fillBlocks(uint nBlock, uint count, void * p);
+  uint queueBlocks(uint nBlock, uint count, void * p, uint writeFlag);
+  uint drainBlocks();
+  void queueRuns(uint * bns, uint n, byte * buf, uint writeFlag);
   uint getFreeBlock();
+  uint setCache(uint nBlocks, uint policy);
+  uint sync();
+  void reload();
 
 private:
+  DiskRequest * freeRequests;	// spares for queueBlocks()
+
+  uint diskBlocks(uint nBlock, uint count, void *p, uint writeFlag);
   uint rdwrBlock(uint nBlock, void *p, uint writeFlag);
+  uint rdwrBlocks(uint nBlock, uint count, void *p, uint writeFlag);
+
+  friend class BlockCache;
 };
 
 // VNIN -- volume# i#
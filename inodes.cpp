@@ -8,6 +8,245 @@
 #define xType (fv->superBlock.iHeight - 2)
 #define xFileSize (fv->superBlock.iHeight - 1)
 
+#define NIL ((uint) ~0)
+
+/*
+ * Inodes in use are kept in core, in a cache of slots, each holding
+ * one inode.  Slots are found by i-number through a chained hash
+ * table, and are on a list in the order of their last use.  getInode()
+ * returns a pointer into a slot, which stays valid until the slot is
+ * reused for another inode; a pinned slot (e.g., of an open File) is
+ * never reused.  putInode() only marks the slot dirty; dirty inodes
+ * reach the disk when their slot is reused, or on a sync(), with one
+ * read and one write per block of inodes.
+ */
+
+Inodes::Inodes()
+{
+  fv = 0;
+  uintbuffer = 0;
+  slots = 0;
+  hash = 0;
+  nSlots = 0;
+  nHits = nMisses = nWriteBacks = 0;
+  mapEpoch = 0;
+}
+
+Inodes::~Inodes()
+{
+  freeCache();
+}
+
+void Inodes::freeCache()
+{
+  for (uint x = 0; x < nSlots; x++)
+    delete [] slots[x].pin;
+  delete [] slots;
+  delete [] hash;
+  if (uintbuffer) alignedFree(uintbuffer);
+  slots = 0;
+  hash = 0;
+  nSlots = 0;
+  uintbuffer = 0;
+}
+
+/* pre:: fv->superBlock is initialized;; post:: An empty inode cache
+ * of InodeCacheSZ slots. */
+
+void Inodes::initCache()
+{
+  freeCache();
+  uintbuffer = (uint *) alignedAlloc(fv->superBlock.nBytesPerBlock);
+  hash = new uint[InodeCacheSZ];
+  for (uint h = 0; h < InodeCacheSZ; h++)
+    hash[h] = NIL;
+  mru = lru = NIL;
+  growCache();
+}
+
+/* pre:: 0 < in < nInodes;; post:: Return the slot holding inode in,
+ * NIL if it is not cached. */
+
+uint Inodes::findSlot(uint in)
+{
+  uint x = hash[in % InodeCacheSZ];
+  while (x != NIL && slots[x].in != in)
+    x = slots[x].hnext;
+  return x;
+}
+
+void Inodes::hashRemove(uint x)
+{
+  uint * px = &hash[slots[x].in % InodeCacheSZ];
+  while (*px != x)
+    px = &slots[*px].hnext;
+  *px = slots[x].hnext;
+}
+
+void Inodes::unlinkSlot(uint x)
+{
+  Slot * s = &slots[x];
+  if (s->prev != NIL) slots[s->prev].next = s->next;
+  else mru = s->next;
+  if (s->next != NIL) slots[s->next].prev = s->prev;
+  else lru = s->prev;
+}
+
+/* post:: Put slot x at the most recently used end of the list if
+ * mruFlag, else at the least recently used end. */
+
+void Inodes::pushSlot(uint x, uint mruFlag)
+{
+  Slot * s = &slots[x];
+  if (mruFlag) {
+    s->prev = NIL;
+    s->next = mru;
+    if (mru != NIL) slots[mru].prev = x;
+    else lru = x;
+    mru = x;
+  } else {
+    s->next = NIL;
+    s->prev = lru;
+    if (lru != NIL) slots[lru].next = x;
+    else mru = x;
+    lru = x;
+  }
+}
+
+/* post:: Double the number of slots (or make the first InodeCacheSZ),
+ * the new ones unused and least recently used.  The inodes already
+ * cached keep their storage.  Return the first new slot. */
+
+uint Inodes::growCache()
+{
+  uint n = (nSlots > 0 ? 2 * nSlots : InodeCacheSZ), x;
+  Slot * ns = new Slot[n];
+  for (x = 0; x < nSlots; x++)
+    ns[x] = slots[x];
+  delete [] slots;
+  slots = ns;
+  for (x = nSlots; x < n; x++) {
+    slots[x].in = 0;
+    slots[x].pin = new uint[fv->superBlock.iHeight];
+    slots[x].refs = slots[x].dirty = 0;
+    slots[x].hnext = NIL;
+    pushSlot(x, 0);
+  }
+  x = nSlots;
+  nSlots = n;
+  return x;
+}
+
+/* pre:: slot x is assigned to an inode;; post:: Read that inode from
+ * the disk into the slot.  Return 0 on a failed read. */
+
+uint Inodes::readSlot(uint x)
+{
+  uint in = slots[x].in, ipb = fv->superBlock.inodesPerBlock;
+  if (fv->readBlock(fv->superBlock.nBlockBeginInodes + in / ipb,
+		    uintbuffer) == 0)
+    return 0;
+  memcpy(slots[x].pin, uintbuffer + (in % ipb) * fv->superBlock.iHeight,
+	 fv->superBlock.iWidth * fv->superBlock.iHeight);
+  slots[x].dirty = 0;
+  return 1;
+}
+
+/* pre:: inode in is not cached;; post:: Return a slot holding inode
+ * in, read from the disk.  The least recently used unpinned slot is
+ * reused, its inode written back first if dirty. */
+
+uint Inodes::loadSlot(uint in)
+{
+  uint x = lru;
+  while (x != NIL && slots[x].refs > 0)
+    x = slots[x].prev;
+  if (x == NIL)
+    x = growCache();		// every slot is pinned
+  if (slots[x].in > 0) {
+    if (slots[x].dirty)
+      writeInodeBlock(fv->superBlock.nBlockBeginInodes
+		      + slots[x].in / fv->superBlock.inodesPerBlock);
+    hashRemove(x);
+  }
+  slots[x].in = in;
+  slots[x].hnext = hash[in % InodeCacheSZ];
+  hash[in % InodeCacheSZ] = x;
+  if (readSlot(x) == 0)
+    memset(slots[x].pin, 0, fv->superBlock.iWidth * fv->superBlock.iHeight);
+  nMisses++;
+  return x;
+}
+
+/* pre:: nblock is a block of inodes;; post:: Write it to disk with
+ * the dirty cached inodes that live in it patched in, and mark them
+ * clean. */
+
+void Inodes::writeInodeBlock(uint nblock)
+{
+  uint ipb = fv->superBlock.inodesPerBlock;
+  uint first = (nblock - fv->superBlock.nBlockBeginInodes) * ipb;
+  uint nbytes = fv->superBlock.iWidth * fv->superBlock.iHeight;
+
+  fv->readBlock(nblock, uintbuffer);
+  for (uint in = (first > 0 ? first : 1); in < first + ipb; in++) {
+    uint x = findSlot(in);
+    if (x != NIL && slots[x].dirty) {
+      memcpy(uintbuffer + (in - first) * fv->superBlock.iHeight,
+	     slots[x].pin, nbytes);
+      slots[x].dirty = 0;
+      nWriteBacks++;
+    }
+  }
+  fv->writeBlock(nblock, uintbuffer);
+}
+
+static int byNumber(const void * a, const void * b)
+{
+  uint x = *(uint *) a, y = *(uint *) b;
+  return x < y ? -1 : x > y;
+}
+
+/* post:: Every dirty cached inode is written to disk, in the order of
+ * the blocks of inodes, each such block once.  Return the number of
+ * inode blocks written. */
+
+uint Inodes::sync()
+{
+  uint * blocks = new uint[nSlots > 0 ? nSlots : 1], nd = 0, nw = 0;
+  for (uint x = 0; x < nSlots; x++)
+    if (slots[x].in > 0 && slots[x].dirty)
+      blocks[nd++] = fv->superBlock.nBlockBeginInodes
+	+ slots[x].in / fv->superBlock.inodesPerBlock;
+  qsort(blocks, nd, sizeof(uint), byNumber);
+  for (uint i = 0; i < nd; i++)
+    if (i == 0 || blocks[i] != blocks[i - 1]) {
+      writeInodeBlock(blocks[i]);
+      nw++;
+    }
+  delete [] blocks;
+  return nw;
+}
+
+/* post:: Sync, then forget the cached inodes, as the disk may have
+ * been changed behind our back.  Pinned inodes are re-read. */
+
+void Inodes::discard()
+{
+  sync();
+  for (uint x = 0; x < nSlots; x++)
+    if (slots[x].in > 0) {
+      if (slots[x].refs > 0) {
+	readSlot(x);
+	continue;
+      }
+      hashRemove(x);
+      slots[x].in = 0;
+      unlinkSlot(x);
+      pushSlot(x, 0);
+    }
+}
+
 /* pre:: fv->superBlock partially initialized, iHeight includes
  * file-size field, iHeight >= 3 ;; post:: Construct the inode array
  * on the disk. */
@@ -35,52 +274,73 @@ uint Inodes::create
   fv->superBlock.iDirect = iHeight - 1 - 1 - iIndirect;	// see xType, xFileSize
 
   // set all inodes to zero, and mark blocks occupied by inodes as in-use
-  uintbuffer = (uint *) new byte[bsz]; // inodes from one block
+  initCache();
   memset(uintbuffer, 0, bsz);
-  for (uint i = fv->superBlock.nBlockBeginInodes,
-       j = i + fv->superBlock.nBlocksOfInodes; i < j; i++) {
-    fv->writeBlock(i, uintbuffer);
-    fv->fbvBlocks.setBit(i, 0);
-  }
+  fv->fillBlocks(nBegin, fv->superBlock.nBlocksOfInodes, uintbuffer);
+  fv->fbvBlocks.setBits(nBegin, fv->superBlock.nBlocksOfInodes, 0);
   return nInodes;
 }
 
 uint Inodes::reCreate(FileVolume * pfv)
 {
   fv = pfv;
-  uint bsz = fv->superBlock.nBytesPerBlock;
-  uintbuffer = (uint *) new byte[bsz];
+  initCache();
   return fv->superBlock.nInodes;
 }
 
-/* pre:: 0 < in < nInodes;; post:: Read the disk block containing
- * inode numbered in into uintbuffer, and return a ptr to it. If ne !=
- * 0, set *ne to the number of blocks in file with inode in. */
+/* pre:: 0 < in < nInodes;; post:: Return a ptr to the cached inode
+ * numbered in, reading it in if need be.  If ne != 0, set *ne to the
+ * number of blocks in file with inode in. */
 
 uint *Inodes::getInode(uint in, uint * ne)
 {
-  uint nblock = fv->superBlock.nBlockBeginInodes
-      + in / fv->superBlock.inodesPerBlock;
-  fv->readBlock(nblock, uintbuffer);
-  uint *pin = uintbuffer
-      + (in % fv->superBlock.inodesPerBlock) * fv->superBlock.iHeight;
+  uint x = findSlot(in);
+  if (x == NIL)
+    x = loadSlot(in);
+  else
+    nHits++;
+  if (x != mru) {
+    unlinkSlot(x);
+    pushSlot(x, 1);
+  }
+  uint *pin = slots[x].pin;
   if (ne != 0) {
     uint bsz = fv->superBlock.nBytesPerBlock;
-    uint fileSize = pin[xFileSize];
+    uint fileSize = (pin[xType] & iInlineFLAG ? 0 : pin[xFileSize]);
     *ne = (fileSize + bsz - 1) / bsz;
   }
   return pin;
 }
 
-/* pre:: inode numbered in is residing in uintbuffer ;; post:: Write
- * the inode numbered in to disk from uintbuffer. Other inodes that
- * happen to be in the uintbuffer also will be written out to disk. */
+/* pre:: inode numbered in is cached, and was changed through the ptr
+ * getInode() returned;; post:: Mark it to be written to disk. */
 
 uint Inodes::putInode(uint in)
 {
-  uint nblock = fv->superBlock.nBlockBeginInodes
-      + in / fv->superBlock.inodesPerBlock;
-  return fv->writeBlock(nblock, uintbuffer);
+  uint x = findSlot(in);
+  if (x == NIL)
+    return 0;
+  slots[x].dirty = 1;
+  return 1;
+}
+
+/* pre:: 0 < in < nInodes;; post:: Keep inode in cached, and the ptr
+ * returned valid, until a matching unpinInode(in). */
+
+uint * Inodes::pinInode(uint in)
+{
+  if (in == 0 || in >= fv->superBlock.nInodes)
+    return 0;
+  uint * pin = getInode(in, 0);
+  slots[mru].refs++;
+  return pin;
+}
+
+void Inodes::unpinInode(uint in)
+{
+  uint x = (in > 0 && nSlots > 0 ? findSlot(in) : NIL);
+  if (x != NIL && slots[x].refs > 0)
+    slots[x].refs--;
 }
 
 /* pre:: none ;; post:: Return the number of a free inode,
@@ -114,14 +374,61 @@ uint Inodes::setEntry(uint in, uint x, uint tp)
   return pin[x];
 }
 
+/* The type field also holds the depth of an extent tree; see
+ * extents.C. */
+
 uint Inodes::getType(uint in)
 {
-  return getEntry(in, xType);
+  return getEntry(in, xType) & iTypeMASK;
 }
 
 uint Inodes::setType(uint in, uint tp)
 {
-  return setEntry(in, xType, tp);
+  uint *pin = getInode(in, 0);
+  pin[xType] = (pin[xType] & ~(uint) iTypeMASK) | tp;
+  putInode(in);
+  return tp;
+}
+
+static int byInumber(const void * a, const void * b)
+{
+  ulong x = *(ulong *) a, y = *(ulong *) b;
+  return x < y ? -1 : x > y;
+}
+
+/* pre:: 0 < ins[k] < nInodes, for k < n;; post:: Set types[k] and
+ * sizes[k] to the type and file size of inode ins[k].  The i-numbers
+ * are taken in sorted order, so that each block of inodes not already
+ * cached is read once; such inodes are not brought into the cache,
+ * which a listing of a large directory would only flush. */
+
+void Inodes::getTypesAndSizes(uint * ins, uint n, uint * types, uint * sizes)
+{
+  uint ipb = fv->superBlock.inodesPerBlock, inBuf = NIL;
+  ulong * keys = new ulong[n > 0 ? n : 1];	// i-number, then index
+  for (uint k = 0; k < n; k++)
+    keys[k] = (ulong) ins[k] << 32 | k;
+  qsort(keys, n, sizeof(ulong), byInumber);
+  for (uint i = 0; i < n; i++) {
+    uint in = keys[i] >> 32, k = keys[i] & 0xffffffff;
+    uint x = findSlot(in), * pin;
+    if (x != NIL) {
+      pin = slots[x].pin;		// may be newer than the disk
+      nHits++;
+    } else {
+      if (in / ipb != inBuf) {
+	inBuf = in / ipb;
+	if (fv->readBlock(fv->superBlock.nBlockBeginInodes + inBuf,
+			  uintbuffer) == 0)
+	  memset(uintbuffer, 0, fv->superBlock.nBytesPerBlock);
+      }
+      pin = uintbuffer + (in % ipb) * fv->superBlock.iHeight;
+      nMisses++;
+    }
+    types[k] = pin[xType] & iTypeMASK;
+    sizes[k] = pin[xFileSize];
+  }
+  delete [] keys;
 }
 
 /* pre:: 0 < in < nInodes ;; post:: Return the size of file whose
@@ -134,6 +441,8 @@ uint Inodes::getFileSize(uint in)
 
 uint Inodes::setFileSize(uint in, uint sz)
 {
+  if (sz == 0 && isInline(in))
+    clearInline(in, 0);		// an empty file is not inline
   return setEntry(in, xFileSize, sz);
 }
 
@@ -145,48 +454,175 @@ uint Inodes::incFileSize(uint in, int inc)
   return pin[xFileSize];
 }
 
+/*
+ * A file small enough, e.g., a new directory, keeps its content in
+ * the inode itself, in the entries 0 .. xType-1 that otherwise map its
+ * blocks, and iInlineFLAG is set in its type field.  Such a file has
+ * no blocks: getInode() says it maps 0 of them.  File moves the
+ * content to a block of its own once it outgrows inlineMax() bytes.
+ */
+
+uint Inodes::isInline(uint in)
+{
+  return (getEntry(in, xType) & iInlineFLAG) != 0;
+}
+
+/* post:: Return the largest content that fits in an inode. */
+
+uint Inodes::inlineMax()
+{
+  return xType * fv->superBlock.iWidth;
+}
+
+/* pre:: isInline(in), p[] is at least inlineMax() long;; post::
+ * Deposit the content of the file into p[], and return its size. */
+
+uint Inodes::getInline(uint in, byte * p)
+{
+  uint *pin = getInode(in, 0);
+  memcpy(p, pin, pin[xFileSize]);
+  return pin[xFileSize];
+}
+
+/* pre:: the file has no blocks, size <= inlineMax();; post:: Make
+ * p[0..size-1] the content of the file, kept inline.  An empty file
+ * is not inline.  Return size. */
+
+uint Inodes::setInline(uint in, byte * p, uint size)
+{
+  uint *pin = getInode(in, 0);
+  memset(pin, 0, inlineMax());
+  memcpy(pin, p, size);
+  pin[xFileSize] = size;
+  if (size > 0) pin[xType] |= iInlineFLAG;
+  else pin[xType] &= ~(uint) iInlineFLAG;
+  putInode(in);
+  return size;
+}
+
+/* pre:: isInline(in), and block bn, if > 0, holds its content;; post::
+ * The file is no longer inline, and bn is its block 0.  Return 0 if
+ * bn could not be mapped. */
+
+uint Inodes::clearInline(uint in, uint bn)
+{
+  uint *pin = getInode(in, 0);
+  memset(pin, 0, inlineMax());
+  pin[xType] &= ~(uint) iInlineFLAG;
+  uint ok = (bn == 0 || setBlockNumber(pin, 0, bn) > 0);
+  if (!ok) pin[xFileSize] = 0;	// content is lost
+  putInode(in);
+  return ok;
+}
+
+/* pre:: *pbn is 0 or the number of an indirect block of the given
+ * level (1 for single, 2 for double, ...) that maps nu blocks, if bn >
+ * 0, or nu+1 blocks, if bn == 0;; post:: Make bn the block number nu
+ * under it, allocating the indirect blocks on the way as need be.
+ * With bn == 0, release block nu, and the indirect blocks that it
+ * leaves empty.  Return as setBlockNumber() does. */
+
+uint Inodes::setIndirect(uint * pbn, uint level, uint nu, uint bn)
+{
+  uint bsz = fv->superBlock.nBytesPerBlock;
+  uint bnpb = bsz / fv->superBlock.iWidth, fresh = 0, changed;
+  ulong span = 1;			// blocks mapped by one entry
+  for (uint i = 1; i < level; i++)
+    span *= bnpb;
+
+  if (*pbn == 0) {
+    uint goal = bn;		// near the data block it maps
+    if (bn == 0 || fv->fbvBlocks.allocRange(1, &goal, allocFirstFit) == 0)
+      return 0;
+    *pbn = goal;
+    fresh = 1;
+  }
+  uint * ib = (uint *) alignedAlloc(bsz);
+  if (fresh)
+    memset(ib, 0, bsz);
+  else
+    fv->readBlock(*pbn, ib);
+
+  uint x = nu / span;
+  if (level > 1)
+    changed = setIndirect(&ib[x], level - 1, nu % span, bn);
+  else if (bn > 0 || ib[x] > 0) {
+    if (bn == 0) fv->fbvBlocks.setBit(ib[x], 1);
+    ib[x] = bn;
+    changed = (bn > 0? 1 : 2);
+  } else
+    changed = 0;
+
+  if ((changed == 0 && fresh) || (changed == 2 && nu == 0)) {
+    fv->fbvBlocks.setBit(*pbn, 1);	// empty
+    *pbn = 0;
+  } else if (changed > 0)
+    fv->writeBlock(*pbn, ib);
+  alignedFree(ib);
+  return changed;
+}
+
 uint Inodes::setSingleIndirect(uint * single, uint nu, uint bn)
 {
-  return TODO("Inodes::setSingleIndirect");
+  return setIndirect(single, 1, nu, bn);
 }
 
 uint Inodes::setDoubleIndirect(uint * duble, uint nu, uint bn)
 {
-  return TODO("Inodes::setDoubleIndirect");
+  return setIndirect(duble, 2, nu, bn);
 }
 
 uint Inodes::setTripleIndirect(uint * triple, uint nu, uint bn)
 {
-  return TODO("Inodes::setTripleIndirect");
+  return setIndirect(triple, 3, nu, bn);
 }
 
-/* pre:: none;; post:: To inode numbered in, append block number bn.  */
+/* pre:: pin points to a cached inode that maps nu blocks;;
+ * post:: Make bn its block number nu.  Return 0 if that was not
+ * possible, 1 if bn > 0 was set, 2 if a block was released. */
 
-uint Inodes::setLastBlockNumber(uint in, uint bn)
+uint Inodes::setBlockNumber(uint * pin, uint nu, uint bn)
 {
   uint bnpb = fv->superBlock.nBytesPerBlock / fv->superBlock.iWidth;
   uint iDirect = fv->superBlock.iDirect;
-  uint iIndirectOne = iDirect + bnpb;
-  uint iIndirectTwo = iIndirectOne + bnpb * bnpb;
-  uint iIndirectThree = iIndirectTwo + bnpb * bnpb * bnpb;
+  ulong iIndirectOne = iDirect + bnpb;
+  ulong iIndirectTwo = iIndirectOne + (ulong) bnpb * bnpb;
+  ulong iIndirectThree = iIndirectTwo + (ulong) bnpb * bnpb * bnpb;
+  uint changed = 0;
 
-  uint nu, *pin = getInode(in, &nu), changed = 0;
+  if (fv->superBlock.iFormat == iFormatExtents)
+    return (bn > 0 ? extAddRun(pin, nu, bn, 1) : extReleaseLast(pin));
 
-  // pin[iDirect+2] may be 0
-  // pin[iDirect+1] may be 0
+  // The inode has xType - iDirect indirect entries, 0 .. 3 of them.
 
   if (nu >= iIndirectThree) ; // beyond capacity!
-  else if (nu >= iIndirectTwo)
-    changed = setTripleIndirect(&pin[iDirect+2], nu - iIndirectTwo , bn);
-  else if (nu >= iIndirectOne)
-    changed = setDoubleIndirect(&pin[iDirect+1], nu - iIndirectOne, bn);
-  else if (nu >= iDirect)
-    changed = setSingleIndirect(&pin[iDirect], nu - iDirect, bn);
-  else {
+  else if (nu >= iIndirectTwo) {
+    if (iDirect + 2 < xType)
+      changed = setTripleIndirect(&pin[iDirect+2], nu - iIndirectTwo , bn);
+  } else if (nu >= iIndirectOne) {
+    if (iDirect + 1 < xType)
+      changed = setDoubleIndirect(&pin[iDirect+1], nu - iIndirectOne, bn);
+  } else if (nu >= iDirect) {
+    if (iDirect < xType)
+      changed = setSingleIndirect(&pin[iDirect], nu - iDirect, bn);
+  } else {
     if (bn == 0) fv->fbvBlocks.setBit(pin[nu], 1);
     pin[nu] = bn;		// nu < iDirect
     changed = (bn > 0? 1 : 2);
   }
+  return changed;
+}
+
+/* pre:: none;; post:: To inode numbered in, append block number bn.
+ * With bn == 0, release the last block instead.  */
+
+uint Inodes::setLastBlockNumber(uint in, uint bn)
+{
+  uint nu, *pin = getInode(in, &nu);
+  if (bn == 0 && nu-- == 0)
+    return 0;
+  uint changed = setBlockNumber(pin, nu, bn);
+  if (changed == 2) mapEpoch++;
   if (changed > 0) putInode(in);
   return 1;
 }
@@ -200,23 +636,76 @@ uint Inodes::addBlockNumber(uint in, uint bn)
     : setLastBlockNumber(in, bn);
 }
 
-/* pre:: 0 <= yth < block-numbers-per-block;; post:: From the single
- * indirect block numbered bn, obtain the xth entry.;;
+/* pre:: the file size of inode in is a multiple of nBytesPerBlock,
+ * bns[0..n-1] are in-use blocks holding nBytes of new content;; post::
+ * Append as many of bns[] as the inode can map, and grow the file size
+ * by their share of nBytes, with a single write of the inode.  Return
+ * the number of block numbers appended. */
+
+uint Inodes::addBlockNumbers(uint in, uint * bns, uint n, uint nBytes)
+{
+  if (in == 0 || in >= fv->superBlock.nInodes)
+    return 0;
+
+  uint bsz = fv->superBlock.nBytesPerBlock;
+  uint nu, *pin = getInode(in, &nu), k, len;
+  for (k = 0; k < n; k += len) {
+    if (bns[k] == 0 || bns[k] >= fv->superBlock.nTotalBlocks)
+      break;
+    len = 1;
+    if (fv->superBlock.iFormat == iFormatExtents) {	// a run at a time
+      while (k + len < n && bns[k + len] == bns[k] + len
+	     && bns[k + len] < fv->superBlock.nTotalBlocks)
+	len++;
+      if (extAddRun(pin, nu + k, bns[k], len) == 0)
+	break;
+    } else if (setBlockNumber(pin, nu + k, bns[k]) == 0)
+      break;
+  }
+  pin[xFileSize] += (k < n ? k * bsz : nBytes);
+  if (k > 0) putInode(in);
+  return k;
+}
+
+/* pre:: bn is 0 or an indirect block of the given level (1 for
+ * single, 2 for double, ...);; post:: Return the block number nth
+ * under it, 0 if there is none. */
+
+uint Inodes::getIndirect(uint bn, uint level, uint nth)
+{
+  uint bsz = fv->superBlock.nBytesPerBlock;
+  uint bnpb = bsz / fv->superBlock.iWidth;
+  ulong span = 1;
+  for (uint i = 1; i < level; i++)
+    span *= bnpb;
+
+  uint * ib = (uint *) alignedAlloc(bsz);
+  for (; bn > 0 && level > 0; level--, span /= bnpb) {
+    fv->readBlock(bn, ib);
+    bn = ib[nth / span];
+    nth %= span;
+  }
+  alignedFree(ib);
+  return bn;
+}
+
+/* pre:: 0 <= nth < block-numbers-per-block;; post:: From the single
+ * indirect block numbered bn, obtain the nth entry.;;
  */
 
 uint Inodes::getBlockNumberSingleIndirect(uint bn, uint nth)
 {
-  return TODO("Inodes::getBlockNumberSingleIndirect");
+  return getIndirect(bn, 1, nth);
 }
 
 uint Inodes::getBlockNumberDoubleIndirect(uint bn, uint nth)
 {
-  return TODO("Inodes::getBlockNumberDoubleIndirect");
+  return getIndirect(bn, 2, nth);
 }
 
 uint Inodes::getBlockNumberTripleIndirect(uint bn, uint nth)
 {
-  return TODO("Inodes::getBlockNumberTripleIndirect");
+  return getIndirect(bn, 3, nth);
 }
 
 /* pre:: inode numbered in is in-use;; post:: Return the n-th block
@@ -227,39 +716,182 @@ uint Inodes::getBlockNumber(uint in, uint nth)
   uint nthmax, *pin = getInode(in, &nthmax);
   if (nth >= nthmax)
     return 0;
+  if (fv->superBlock.iFormat == iFormatExtents)
+    return extFind(pin, nth, 0);
 
   uint iDirect = fv->superBlock.iDirect;
   if (nth < iDirect)
     return pin[nth];
 
   uint bnpb = fv->superBlock.nBytesPerBlock / fv->superBlock.iWidth;
-  uint iIndirectOne = iDirect + bnpb;
+  ulong iIndirectOne = iDirect + bnpb;
   if (nth < iIndirectOne)
-    return getBlockNumberSingleIndirect(pin[iDirect], nth - iDirect);
+    return (iDirect < xType
+	    ? getBlockNumberSingleIndirect(pin[iDirect], nth - iDirect) : 0);
 
-  uint iIndirectTwo = iIndirectOne + bnpb * bnpb;
+  ulong iIndirectTwo = iIndirectOne + (ulong) bnpb * bnpb;
   if (nth < iIndirectTwo)
-    return getBlockNumberDoubleIndirect(pin[iDirect+1], nth - iIndirectOne);
+    return (iDirect + 1 < xType
+	    ? getBlockNumberDoubleIndirect(pin[iDirect+1], nth - iIndirectOne)
+	    : 0);
 
-  uint iIndirectThree = iIndirectTwo + bnpb * bnpb * bnpb;
+  ulong iIndirectThree = iIndirectTwo + (ulong) bnpb * bnpb * bnpb;
   if (nth < iIndirectThree)
-    return getBlockNumberTripleIndirect(pin[iDirect+2], nth - iIndirectTwo);
+    return (iDirect + 2 < xType
+	    ? getBlockNumberTripleIndirect(pin[iDirect+2], nth - iIndirectTwo)
+	    : 0);
 
   return 0;
 }
 
+/* pre:: bn is 0 or an indirect block of the given level, x is the
+ * index of a block under it;; post:: Deposit into out[] the block
+ * numbers x, x+1, ... under bn, at most count of them, reading each
+ * indirect block under bn at most once.  Return the number deposited;
+ * fewer than count if the blocks under bn run out. */
+
+uint Inodes::mapRange(uint bn, uint level, ulong x, uint count, uint * out)
+{
+  if (bn == 0 || count == 0)
+    return 0;
+
+  uint bsz = fv->superBlock.nBytesPerBlock;
+  uint bnpb = bsz / fv->superBlock.iWidth, n = 0;
+  ulong span = 1;
+  for (uint i = 1; i < level; i++)
+    span *= bnpb;
+
+  uint * ib = (uint *) alignedAlloc(bsz);
+  fv->readBlock(bn, ib);
+  for (uint i = x / span; i < bnpb && n < count; i++, x = 0)
+    if (level == 1) {
+      if (ib[i] == 0)
+	break;
+      out[n++] = ib[i];
+    } else {
+      uint want = count - n;
+      uint got = mapRange(ib[i], level - 1, x % span, want, out + n);
+      n += got;
+      if (got < want && got < span - x % span)
+	break;			// a hole
+    }
+  alignedFree(ib);
+  return n;
+}
+
+/* pre:: inode numbered in is in-use, out[] has room for count
+ * entries;; post:: Deposit into out[] the block numbers first,
+ * first+1, ..., first+count-1 of the file, those that exist, with one
+ * walk of the inode that reads each indirect block involved once.
+ * Return the number deposited.  If nRuns != 0, set *nRuns to the
+ * number of runs of adjacent block numbers among them; one run can be
+ * moved with a single transfer. */
+
+uint Inodes::getBlockNumbers(uint in, uint first, uint count, uint * out,
+			     uint * nRuns)
+{
+  uint nthmax, *pin = getInode(in, &nthmax), n = 0;
+  if (nRuns != 0)
+    *nRuns = 0;
+  if (first >= nthmax)
+    return 0;
+  if (count > nthmax - first)
+    count = nthmax - first;
+  if (fv->superBlock.iFormat == iFormatExtents)
+    count = n = extMap(pin, first, count, out);
+
+  uint iDirect = fv->superBlock.iDirect;
+  for (; n < count && first + n < iDirect; n++)
+    out[n] = pin[first + n];
+
+  uint bnpb = fv->superBlock.nBytesPerBlock / fv->superBlock.iWidth;
+  ulong base = iDirect, span = bnpb;	// blocks under the level entry
+  for (uint level = 1; level <= 3 && n < count; level++) {
+    if (iDirect + level - 1 >= xType)
+      break;
+    if (first + n < base + span) {
+      uint want = count - n;
+      uint got = mapRange(pin[iDirect + level - 1], level,
+			  first + n - base, want, out + n);
+      n += got;
+      if (got < want && first + n < base + span)
+	break;			// a hole
+    }
+    base += span;
+    span *= bnpb;
+  }
+
+  if (nRuns != 0)
+    for (uint i = 0; i < n; i++)
+      if (i == 0 || out[i] != out[i - 1] + 1)
+	(*nRuns)++;
+  return n;
+}
+
+/* pre:: bn is a block of a file, level 0 for a data block, 1 for a
+ * single indirect block, and so on; *nLeft data blocks of the file
+ * are yet to be seen;; post:: Append bn and every block below it to
+ * bns[*nbns ..], and count the data blocks off *nLeft. */
+
+void Inodes::gatherBlocks(uint bn, uint level, uint * nLeft,
+			  uint * bns, uint * nbns)
+{
+  if (bn == 0 || *nLeft == 0)
+    return;
+  bns[(*nbns)++] = bn;
+  if (level == 0) {
+    (*nLeft)--;
+    return;
+  }
+
+  uint bsz = fv->superBlock.nBytesPerBlock;
+  uint bnpb = bsz / fv->superBlock.iWidth;
+  uint * ib = (uint *) alignedAlloc(bsz);
+  fv->readBlock(bn, ib);
+  for (uint i = 0; i < bnpb && *nLeft > 0; i++)
+    gatherBlocks(ib[i], level - 1, nLeft, bns, nbns);
+  alignedFree(ib);
+}
+
 /* pre:: inode numbered in is in-use;; post:: Release the inode in and
- * all the blocks of file associated with inode in, and update the
- * disk copy of this inode. ;; */
+ * all the blocks of file associated with inode in, its indirect blocks
+ * included, and update the disk copy of this inode.  The blocks are
+ * gathered in one walk of the inode, sorted, and released a run of
+ * adjacent blocks at a time, so the cost is in the bitmap blocks
+ * touched and not in the length of the file. ;; */
 
 uint Inodes::setFree(uint in)
 {
-  uint nu = 0;
-  getInode(in, &nu);
-  for (uint i = nu; i > 0;) {
-    uint bn = getBlockNumber(in, --i);
-    fv->fbvBlocks.setBit(bn, 1);
+  uint nu = 0, *pin = getInode(in, &nu);
+  if (fv->superBlock.iFormat == iFormatExtents) {
+    if ((pin[xType] & iInlineFLAG) == 0)
+      extFree(pin);		// already in runs
+    mapEpoch++;
+    fv->fbvInodes.setBit(in, 1);
+    return nu;
+  }
+
+  uint iDirect = fv->superBlock.iDirect;
+  uint bnpb = fv->superBlock.nBytesPerBlock / fv->superBlock.iWidth;
+  uint ptrs[3], nLeft = nu, nbns = 0, x;
+
+  for (x = 0; x < 3; x++)
+    ptrs[x] = (iDirect + x < xType ? pin[iDirect + x] : 0);
+
+  uint * bns = new uint[nu + 3 * (nu / bnpb + 3)];
+  for (x = 0; x < iDirect && nLeft > 0; x++)
+    gatherBlocks(pin[x], 0, &nLeft, bns, &nbns);
+  for (x = 0; x < 3 && nLeft > 0; x++)
+    gatherBlocks(ptrs[x], x + 1, &nLeft, bns, &nbns);
+
+  qsort(bns, nbns, sizeof(uint), byNumber);
+  for (uint i = 0, j; i < nbns; i = j) {
+    for (j = i + 1; j < nbns && bns[j] == bns[j - 1] + 1; j++)
+      ;
+    fv->fbvBlocks.freeRange(bns[i], j - i);
   }
+  delete [] bns;
+  mapEpoch++;
   fv->fbvInodes.setBit(in, 1);
   return nu;
 }
@@ -85,36 +85,60 @@ void doMakeDisk(Arg * a)
   delete simDisk;
 }
 
+/* The file volume keeps a block cache, so it must be synced before
+ * its disk is touched other than through it -- by a forked child, or
+ * by rddisk/wrdisk -- and reloaded after. */
+
+void syncFV()
+{
+  if (fv)
+    fv->sync();
+}
+
+void reloadFV()
+{
+  if (fv)
+    fv->reload();
+}
+
 void doWriteDisk(Arg * a)
 {
+  syncFV();
   SimDisk * simDisk = mkSimDisk((byte *) a[0].s);
   if (simDisk == 0)
     return;
   char *st = a[2].s;    // arbitrary word
   if (st == 0)      // if it is NULL, we use ...
     st = "CEG433/633/Mateti";
-  char buf[1024];   // assuming nBytesPerSectorMAX < 1024
-  for (uint m = strlen(st), n = 0; n < 1024 - m; n += m)
-    memcpy(buf + n, st, m); // fill with several copies of st
+  uint nbps = simDisk->nBytesPerSector;
+  char *buf = new char[nbps];
+  for (uint m = strlen(st), n = 0; n < nbps; n += m)
+    memcpy(buf + n, st, (m < nbps - n ? m : nbps - n)); // copies of st
   uint r = simDisk->writeSector(a[1].u, (byte *) buf);
   printf("write433disk(%d, %s...) == %d to Disk %s\n", a[1].u, st, r, a[0].s);
+  delete [] buf;
   delete simDisk;
+  reloadFV();
 }
 
 void doReadDisk(Arg * a)
 {
+  syncFV();
   SimDisk * simDisk = mkSimDisk((byte *) a[0].s);
   if (simDisk == 0)
     return;
-  char buf[1024];   // assuming nBytesPerSectorMAX < 1024
+  char *buf = new char[simDisk->nBytesPerSector + 11];
+  memset(buf, 0, simDisk->nBytesPerSector + 11);
   uint r = simDisk->readSector(a[1].u, (byte *) buf);
   buf[10] = 0;      // sentinel
   printf("read433disk(%d, %s...) = %d from Disk %s\n", a[1].u, buf, r, a[0].s);
+  delete [] buf;
   delete simDisk;
 }
 
 void doQuit(Arg * a)
 {
+  syncFV();
   exit(0);
 }
 
@@ -124,14 +148,33 @@ void doEcho(Arg * a)
    a[1].s, a[1].u, a[2].s, a[2].u, a[3].s, a[3].u);
 }
 
+/* mkfs name [nSecPerBlock] [blockmap|extents] [stream|stride] */
+
 void doMakeFV(Arg * a)
 {
+  uint iFormat = iFormatBlockMap, dFormat = dFormatStream;
+  for (uint i = 2; i < 4 && a[i].s != 0; i++)
+    if (strcmp(a[i].s, "extents") == 0)
+      iFormat = iFormatExtents;
+    else if (strcmp(a[i].s, "stride") == 0)
+      dFormat = dFormatStride;
+    else if (strcmp(a[i].s, "blockmap") != 0
+	     && strcmp(a[i].s, "stream") != 0) {
+      printf("mkfs: format must be blockmap, extents, stream or stride\n");
+      return;
+    }
+  syncFV();
   SimDisk * simDisk = mkSimDisk((byte *) a[0].s);
   if (simDisk == 0)
     return;
-  fv = simDisk->make33fv();
+  uint nSecPerBlock = (a[1].s != 0 ? a[1].u : 1);
+  fv = simDisk->make33fv(simDisk->diskParams.nInodes,
+			 simDisk->diskParams.iHeight, nSecPerBlock, iFormat,
+			 dFormat);
   printf("make33fv() = %p, Name == %s, Disk# == %d\n",
    (void*) fv, a[0].s, simDisk->simDiskNum);
+  if (fv && fv->superBlock.iFormat != iFormat)
+    printf("mkfs: extents need an iHeight >= 5, using blockmap\n");
 
   if (fv) {
       wd = new Directory(fv, 1, 0);
@@ -197,6 +240,72 @@ void doInode(Arg * a)
   wd->fv->inodes.show(ni);
 }
 
+/* Check the block bitmap of the current volume, and its summary,
+ * against a plain array with a[0].u random operations from seed
+ * a[1].u.  The bitmap is left as it was.  See CheckScript.txt. */
+
+void doBvCheck(Arg * a)
+{
+  uint nBad = wd->fv->fbvBlocks.selfCheck(a[0].u, a[1].u);
+  printf("bvcheck %s: %u ops, %u errors\n", wd->fv->simDisk->name,
+   a[0].u, nBad);
+}
+
+/* Print the I/O counters of the simulated disk under the current
+ * volume.  Together with !date lines in a script, this is our
+ * benchmark harness; see BenchScript.txt. */
+
+void doIoStat(Arg * a)
+{
+  static const char * modes[] = {"pread", "mmap", "direct"};
+  SimDisk * sd = wd->fv->simDisk;
+  printf("iostat %s: reads=%lu (%lu sectors) writes=%lu (%lu sectors)\n",
+   sd->name, sd->nReads, sd->nSecRead, sd->nWrites, sd->nSecWritten);
+  printf("iostat %s: ioMode %s, queue %s, depth %d, peak %d\n", sd->name,
+   modes[sd->ioMode], sd->getQueue()->kind(), sd->getQueue()->depth,
+   sd->getQueue()->nPeak);
+  BlockCache * bc = wd->fv->cache;
+  if (bc)
+    printf("iostat %s: cache %d blocks %s, hits=%lu misses=%lu"
+     " writebacks=%lu\n", sd->name, bc->nSlots,
+     (bc->policy == cachePolicyARC ? "arc" : "lru"),
+     bc->nHits, bc->nMisses, bc->nWriteBacks);
+  BitVector * bv = &wd->fv->fbvBlocks;
+  printf("iostat %s: blocks free=%u of %u, allocs=%lu words=%lu\n",
+   sd->name, bv->countFree(), wd->fv->superBlock.nTotalBlocks,
+   bv->nAllocs, bv->nWords);
+  Inodes * ic = &wd->fv->inodes;
+  printf("iostat %s: inodes hits=%lu misses=%lu writebacks=%lu\n",
+   sd->name, ic->nHits, ic->nMisses, ic->nWriteBacks);
+  DentryCache * dc = wd->fv->dentries;
+  printf("iostat %s: dentries hits=%lu misses=%lu\n",
+   sd->name, dc->nHits, dc->nMisses);
+}
+
+void doQueueDepth(Arg * a)
+{
+  SimDisk * sd = wd->fv->simDisk;
+  uint d = sd->setQueueDepth(a[0].u);
+  printf("qdepth %s: queue %s, depth %d\n", sd->name,
+   sd->getQueue()->kind(), d);
+}
+
+/* cache nBlocks [lru|arc]; nBlocks == 0 turns the cache off */
+
+void doCache(Arg * a)
+{
+  uint policy = cachePolicyLRU;
+  if (a[1].s != 0 && strcmp(a[1].s, "arc") == 0)
+    policy = cachePolicyARC;
+  else if (a[1].s != 0 && strcmp(a[1].s, "lru") != 0) {
+    printf("cache: policy must be lru or arc\n");
+    return;
+  }
+  uint n = wd->fv->setCache(a[0].u, policy);
+  printf("cache %s: %d blocks %s\n", wd->fv->simDisk->name, n,
+   (policy == cachePolicyARC ? "arc" : "lru"));
+}
+
 void doMkDir(Arg * a)
 {
   TODO("doMkDir");
@@ -250,15 +359,22 @@ public:
   char *globalsNeeded;    // need d==simDisk, v==cfv, m=mtab
   void (*func) (Arg * a);
 } cmdTable[] = {
+  {"cache", "u", "v", doCache},
+  {"cache", "us", "v", doCache},
+  {"bvcheck", "uu", "v", doBvCheck},
   {"cd", "s", "v", doChDir},
   {"cp", "ss", "v", doCopy},
   {"echo", "ssss", "", doEcho},
   {"inode", "u", "v", doInode},
+  {"iostat", "", "v", doIoStat},
   {"ls", "", "v", doLsLong},
   {"lslong", "", "v", doLsLong},
   {"mkdir", "s", "v", doMkDir},
   {"mkdisk", "s", "", doMakeDisk},
   {"mkfs", "s", "", doMakeFV},
+  {"mkfs", "su", "", doMakeFV},
+  {"mkfs", "sus", "", doMakeFV},
+  {"mkfs", "suss", "", doMakeFV},
   {"mount", "us","", doMountUS},
   {"mount", "", "", doMountDF},
   {"mv", "ss", "v", doMv},
@@ -266,6 +382,7 @@ public:
   {"rmdir", "s", "v", doRm},
   {"rm", "s", "v", doRm},
   {"pwd", "", "v", doPwd},
+  {"qdepth", "u", "v", doQueueDepth},
   {"q", "", "", doQuit},
   {"quit", "", "", doQuit},
   {"umount", "u", "m", doUmount},
@@ -418,6 +535,7 @@ void pipingFunction(char* buf)
       buf[i-1]='\0';
       
 
+      syncFV();
       int pid1=fork();
       if (pid1==0)
       {
@@ -440,6 +558,7 @@ void pipingFunction(char* buf)
       else
       {
         while ((wpid = wait(&status)) > 0);
+        reloadFV();
         saved_stdin = dup(STDIN_FILENO);
         dup2(fd[0],STDIN_FILENO);
         close(fd[0]);
@@ -483,6 +602,7 @@ void pipingFunction(char* buf)
       pipe(fd[i]);
     }
     
+    syncFV();
     int pid1=fork();
     if (pid1==0)
     {
@@ -508,6 +628,7 @@ void pipingFunction(char* buf)
     else
     {
       while ((wpid = wait(&status)) > 0);
+      reloadFV();
       strcpy(buf,commandToExecute2);
           int pid2=fork();
           if (pid2==0)
@@ -535,6 +656,7 @@ void pipingFunction(char* buf)
           else
           {
             while ((wpid = wait(&status)) > 0);
+            reloadFV();
             strcpy(buf,commandToExecute3);
             if (buf[0] == '!')    // begins with !, execute it as
               system(buf + 1);    // a normal shell cmd
@@ -567,6 +689,7 @@ void backgroundFunction(char* buf)
   {
       i++;
   }
+  syncFV();
   int pid4=fork();
   if (pid4==0)
   {
@@ -650,6 +773,7 @@ int main()
         if (childFlag==1)
         {
           dup2(saved_stdout, STDOUT_FILENO);
+          syncFV();
           //printf("I am in child");
           exit(0);
         }
@@ -657,6 +781,7 @@ int main()
         {
           dup2(saved_stdout, STDOUT_FILENO);
           dup2(saved_stdin,STDIN_FILENO);
+          syncFV();
           //printf("I am in child");
           exit(0);
         }
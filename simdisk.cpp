@@ -6,10 +6,35 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <limits.h>
 #include <fcntl.h>
 #include "fs33types.hpp"
 
-/* pre:: mode == O_RDONLY or mode == O_WRONLY | O_CREAT;; post::
+// O_DIRECT wants sector sizes, file offsets and buffer addresses to be
+// multiples of the host's logical block size, DirectSZ at most.
+enum { DirectSZ = 512, BufAlignSZ = 4096 };
+
+/* post:: Return nBytes of memory aligned well enough for any of our
+ * disk transfers, O_DIRECT ones included.  Release it with
+ * alignedFree().  Sector and block buffers of the file volume come from
+ * here. */
+
+void * alignedAlloc(uint nBytes)
+{
+  void * p = 0;
+  if (posix_memalign(&p, BufAlignSZ, nBytes > 0 ? nBytes : 1) != 0)
+    return 0;
+  return p;
+}
+
+void alignedFree(void * p)
+{
+  free(p);
+}
+
+/* pre:: mode == O_RDWR, possibly | O_CREAT | O_TRUNC;; post::
  * Systematically make up a name for the disk image file, open the/a file
  * with that pathname, and return its file descriptor.  Returned value
  * can be 0, or negative.;; */
@@ -22,23 +47,22 @@ int SimDisk::openDiskImage(uint mode)
 }
 
 /* pre:: none;; post:: A file named "%s.dsk", where %s stands for the
- * name is created.  Return its file descriptor.  This file
- * will be of size nBytesPerSector x nSectorsPerDisk in bytes, all set
- * to zero.
+ * name is created.  Return its file descriptor, which is left open.
+ * This file will be of size nBytesPerSector x nSectorsPerDisk in
+ * bytes, all set to zero.  It is made by extending an empty file, so
+ * it is sparse: no sector is written, and a multi-GB disk is instant.
  */
 
 int SimDisk::makeDiskImage()
 {
-  int fd = openDiskImage(O_WRONLY | O_CREAT);
+  int fd = openDiskImage(O_RDWR | O_CREAT | O_TRUNC);
   if (fd < 3)
     return fd;
 
-  byte * buf = new byte [nBytesPerSector];
-  memset(buf, 0, nBytesPerSector);
-  for (uint i = nSectorsPerDisk; i--;)
-    write(fd, buf, nBytesPerSector);
-  close(fd);
-  delete buf;
+  if (ftruncate(fd, (off_t) nSectorsPerDisk * nBytesPerSector) != 0) {
+    close(fd);
+    fd = -1;
+  }
   return fd;
 }
 
@@ -54,6 +78,12 @@ SimDisk::SimDisk(byte * diskName, uint diskNumber)
   char line[1024];
   uint nargs = 0;
   simDiskNum = 0;
+  nReads = nWrites = 0;
+  nSecRead = nSecWritten = 0;
+  fd = -1;
+  image = 0;
+  queue = 0;
+  ioMode = ioModePread;
 
   if (diskName != 0) diskNumber = 255 + 1; // assuming a max of 255 disks
 
@@ -66,10 +96,13 @@ SimDisk::SimDisk(byte * diskName, uint diskNumber)
       if (line[0] == '#') {
         continue;               // comment line;
       }
-      nargs = sscanf(line, "%s %u %u %u %u %u\n",
+      char mode[LabelSZ + 1] = "pread"; // the ioMode column is optional
+      nargs = sscanf(line, "%15s %u %u %u %u %u %15s\n",
                      name, &nSectorsPerDisk, &nBytesPerSector,
                      &diskParams.maxfnm, &diskParams.nInodes,
-                     &diskParams.iHeight);
+                     &diskParams.iHeight, mode);
+      ioMode = (strcmp(mode, "mmap") == 0 ? ioModeMmap
+		: strcmp(mode, "direct") == 0 ? ioModeDirect : ioModePread);
       if (nargs < 6) {
         break;                  // end of file
       }
@@ -88,50 +121,261 @@ SimDisk::SimDisk(byte * diskName, uint diskNumber)
     return;
   }
 
-  int fd = openDiskImage(O_RDONLY), exists = (fd >= 3); // already exists?
+  fd = openDiskImage(O_RDWR);
+  int exists = (fd >= 3);	// already exists?
   if (exists) {
-    struct stat statBuf;
-    fstat(fd, &statBuf);
-   close(fd);		    // file exists, but is it a valid simDisk?
-     exists = (uint) statBuf.st_size == nSectorsPerDisk * nBytesPerSector;
+    struct stat statBuf;	// file exists, but is it a valid simDisk?
+    exists = fstat(fd, &statBuf) == 0 &&
+      statBuf.st_size == (off_t) nSectorsPerDisk * nBytesPerSector;
+    if (! exists) {
+      close(fd);
+      fd = -1;
+    }
   }
   if (! exists) {
     fd = makeDiskImage();
     if (fd < 3) nSectorsPerDisk = 0; // robust
   }
+  if (fd >= 3 && ioMode == ioModeDirect) {
+    // bypass the host page cache; robust: else fall back to pread/pwrite
+    int dfd = (nBytesPerSector % DirectSZ == 0
+	       ? openDiskImage(O_RDWR | O_DIRECT) : -1);
+    if (dfd >= 3) {
+      close(fd);
+      fd = dfd;
+    } else
+      ioMode = ioModePread;
+  }
+  if (fd >= 3 && ioMode == ioModeMmap) {
+    void * m = mmap(0, (size_t) nSectorsPerDisk * nBytesPerSector,
+		    PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (m == MAP_FAILED)
+      ioMode = ioModePread;	// robust: fall back to pread/pwrite
+    else
+      image = (byte *) m;
+  }
 }
 
-uint SimDisk::readSector(uint nSector, void *p)
+SimDisk::~SimDisk()
+{
+  delete queue;			// waits for its transfers to finish
+  flush();
+  if (image != 0)
+    munmap(image, (size_t) nSectorsPerDisk * nBytesPerSector);
+  if (fd >= 3)
+    close(fd);
+}
+
+/* pre:: none;; post:: Push the sectors written so far out to the disk
+ * image.  Only an mmap-ed image has anything to push; pwrite() has
+ * already handed the data to the host.  Return 1 on success. */
+
+uint SimDisk::flush()
 {
-  if (p == 0 || nSector >= nSectorsPerDisk)
+  if (image == 0)
+    return 1;
+  return msync(image, (size_t) nSectorsPerDisk * nBytesPerSector,
+	       MS_SYNC) == 0;
+}
+
+/* post:: Count one transfer of nSectors.  Transfers queued with
+ * submit() may run on other threads, hence the atomic adds. */
+
+void SimDisk::countTransfer(ulong nsecs, uint writeFlag)
+{
+  if (writeFlag) {
+    __sync_fetch_and_add(&nWrites, 1);
+    __sync_fetch_and_add(&nSecWritten, nsecs);
+  } else {
+    __sync_fetch_and_add(&nReads, 1);
+    __sync_fetch_and_add(&nSecRead, nsecs);
+  }
+}
+
+/* post:: Would a transfer to/from the iov[] buffers go through as
+ * is?  Only O_DIRECT has alignment rules. */
+
+uint SimDisk::isAligned(struct iovec * iov, uint iovcnt)
+{
+  if (ioMode != ioModeDirect)
+    return 1;
+  for (uint i = 0; i < iovcnt; i++)
+    if ((ulong) iov[i].iov_base % DirectSZ != 0
+	|| iov[i].iov_len % DirectSZ != 0)
+      return 0;
+  return 1;
+}
+
+/* pre:: iov[0 .. iovcnt-1] together cover a whole number of sectors;;
+ * post:: Transfer the sectors beginning at nSector into (writeFlag ==
+ * 0) or out of the iov[] buffers, one positioned preadv/pwritev per
+ * IOV_MAX buffers, or memcpy-s on a mapped image.  Buffers that an
+ * O_DIRECT disk cannot take as they are go through an aligned bounce
+ * buffer.  Return the number of bytes transferred, 0 on any failure. */
+
+uint SimDisk::rdwrSectorsv(uint nSector, struct iovec * iov, uint iovcnt,
+			   uint writeFlag)
+{
+  ulong nbytes = 0;
+  for (uint i = 0; i < iovcnt; i++) {
+    if (iov[i].iov_base == 0)
+      return 0;
+    nbytes += iov[i].iov_len;
+  }
+  ulong nsecs = nbytes / nBytesPerSector;
+  if (fd < 3 || nbytes == 0 || nbytes % nBytesPerSector != 0
+      || nSector >= nSectorsPerDisk || nsecs > nSectorsPerDisk - nSector)
     return 0;
-  int fd = openDiskImage(O_RDONLY);
-  lseek(fd, nBytesPerSector * nSector, SEEK_SET);
-  read(fd, p, nBytesPerSector);
-  close(fd);
-  return nBytesPerSector;
+
+  off_t off = (off_t) nBytesPerSector * nSector;
+  countTransfer(nsecs, writeFlag);
+  if (image != 0) {
+    for (uint i = 0; i < iovcnt; off += iov[i++].iov_len)
+      if (writeFlag)
+	memcpy(image + off, iov[i].iov_base, iov[i].iov_len);
+      else
+	memcpy(iov[i].iov_base, image + off, iov[i].iov_len);
+    return nbytes;
+  }
+
+  struct iovec * userIov = iov, biov;
+  uint userIovcnt = iovcnt;
+  byte * bounce = 0;
+  if (! isAligned(iov, iovcnt)) {
+    bounce = (byte *) alignedAlloc(nbytes);
+    if (bounce == 0)
+      return 0;
+    for (uint i = 0, x = 0; writeFlag && i < iovcnt; x += iov[i++].iov_len)
+      memcpy(bounce + x, iov[i].iov_base, iov[i].iov_len);
+    biov.iov_base = bounce;
+    biov.iov_len = nbytes;
+    iov = &biov;
+    iovcnt = 1;
+  }
+
+  while (iovcnt > 0) {
+    uint n = (iovcnt > IOV_MAX ? IOV_MAX : iovcnt);
+    ssize_t want = 0;
+    for (uint i = 0; i < n; i++)
+      want += iov[i].iov_len;
+    ssize_t got = (writeFlag
+		   ? pwritev(fd, iov, n, off)
+		   : preadv(fd, iov, n, off));
+    if (got != want) {
+      nbytes = 0;
+      break;
+    }
+    off += got;
+    iov += n;
+    iovcnt -= n;
+  }
+
+  if (bounce != 0) {
+    for (uint i = 0, x = 0; nbytes && ! writeFlag && i < userIovcnt;
+	 x += userIov[i++].iov_len)
+      memcpy(userIov[i].iov_base, bounce + x, userIov[i].iov_len);
+    alignedFree(bounce);
+  }
+  return nbytes;
+}
+
+uint SimDisk::readSectorsv(uint nSector, struct iovec * iov, uint iovcnt)
+{
+  return rdwrSectorsv(nSector, iov, iovcnt, 0);
+}
+
+uint SimDisk::writeSectorsv(uint nSector, struct iovec * iov, uint iovcnt)
+{
+  return rdwrSectorsv(nSector, iov, iovcnt, 1);
+}
+
+/* pre:: p points to count * nBytesPerSector bytes;; post:: Read the
+ * count sectors nSector, nSector+1, ... into p[] with one transfer.
+ * Return the number of bytes read, 0 on any failure. */
+
+uint SimDisk::readSectors(uint nSector, uint count, void *p)
+{
+  struct iovec iov;
+  iov.iov_base = p;
+  iov.iov_len = (size_t) count * nBytesPerSector;
+  return rdwrSectorsv(nSector, &iov, 1, 0);
+}
+
+uint SimDisk::writeSectors(uint nSector, uint count, void *p)
+{
+  struct iovec iov;
+  iov.iov_base = p;
+  iov.iov_len = (size_t) count * nBytesPerSector;
+  return rdwrSectorsv(nSector, &iov, 1, 1);
+}
+
+uint SimDisk::readSector(uint nSector, void *p)
+{
+  return readSectors(nSector, 1, p);
 }
 
 uint SimDisk::writeSector(uint nSector, void *p)
 {
-  if (p == 0 || nSector >= nSectorsPerDisk)
-    return 0;
-  int fd = openDiskImage(O_WRONLY);
-  lseek(fd, nBytesPerSector * nSector, SEEK_SET);
-  write(fd, p, nBytesPerSector);
-  close(fd);
-  return nBytesPerSector;
+  return writeSectors(nSector, 1, p);
+}
+
+/* pre:: depth > 0;; post:: Replace the queue used by submit()/reap()
+ * with one allowing depth requests in flight, after the old one has
+ * finished all of its transfers.  Return the new depth. */
+
+uint SimDisk::setQueueDepth(uint depth)
+{
+  delete queue;
+  queue = newDiskQueue(this, depth > 0 ? depth : 1);
+  return queue->depth;
+}
+
+DiskQueue * SimDisk::getQueue()
+{
+  if (queue == 0)
+    queue = newDiskQueue(this, 1);
+  return queue;
+}
+
+/* pre:: r->nSector, count, p, writeFlag are set;; post:: Start the
+ * transfer r.  r, and its buffer, belong to the queue until reap()
+ * returns r.  Return 0 if r is invalid; it is then reaped at once with
+ * r->result == 0. */
+
+uint SimDisk::submit(DiskRequest * r)
+{
+  return getQueue()->submit(r);
+}
+
+/* post:: Return a completed request, or 0 if none is in flight.  If
+ * waitFlag == 0, also return 0 rather than wait for one. */
+
+DiskRequest * SimDisk::reap(uint waitFlag)
+{
+  return getQueue()->reap(waitFlag);
+}
+
+/* Make a new file volume on this disk. */
+
+FileVolume *SimDisk::make33fv(uint nInodes, uint htInode, uint nSecPerBlock,
+			      uint iFormat, uint dFormat)
+{
+  return nSectorsPerDisk > 0 && nSecPerBlock > 0
+    ? new FileVolume(this, nInodes, htInode, nSecPerBlock, iFormat, dFormat)
+    : 0;
+}
+
+FileVolume *SimDisk::make33fv(uint nInodes, uint htInode, uint nSecPerBlock)
+{
+  return make33fv(nInodes, htInode, nSecPerBlock, iFormatBlockMap,
+		  dFormatStream);
 }
 
 /* "Find" a file volume previously made. */
 
 FileVolume *SimDisk::make33fv()
 {
-  return nSectorsPerDisk > 0
-    ? new FileVolume(this,
-                     diskParams.nInodes,
-                     diskParams.iHeight,
-                     1) : 0;
+  return make33fv(diskParams.nInodes, diskParams.iHeight, 1);
 }
 
 /* -eof- */
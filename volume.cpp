@@ -18,15 +18,25 @@
  */
 
 #include "fs33types.hpp"
+#include <sys/uio.h>
 
 /* pre:: Valid psimDisk ;; post:: On the simulated disk identified by
- * psimDisk, construct a new file volume with nInodes and of
- * iHeight. */
-
-FileVolume::FileVolume(SimDisk * psimDisk,
-		       uint nInodes, uint iHeight, uint nSecPerBlock)
+ * psimDisk, construct a new file volume with nInodes and of iHeight,
+ * whose inodes map blocks as iFormat says, and whose directories lay
+ * out entries as dFormat says.  Extents need room for one (logical,
+ * physical, length) record besides the type and size fields, i.e.,
+ * iHeight >= 5; with less, the volume uses the block map.  In stride
+ * format, a name is at most 255 bytes, and its record fits a block. */
+
+FileVolume::FileVolume(SimDisk * psimDisk, uint nInodes, uint iHeight,
+		       uint nSecPerBlock, uint iFormat, uint dFormat)
 {
   simDisk = psimDisk;
+  freeRequests = 0;
+  cache = 0;
+  dentries = new DentryCache(DentryCacheSZ);
+  dirDeadBytes = 0;
+  dirIndexes = 0;
   memset(&superBlock, 0, sizeof(superBlock));
   if (nInodes == 0 || iHeight < 3 || nSecPerBlock == 0
       || simDisk->nBytesPerSector < sizeof(superBlock))		// too small
@@ -36,6 +46,11 @@ FileVolume::FileVolume(SimDisk * psimDisk,
   superBlock.nBytesPerBlock = nSecPerBlock * simDisk->nBytesPerSector;
   superBlock.nSecPerBlock = nSecPerBlock;
   superBlock.fileNameLengthMax = psimDisk->nBytesPerSector;	// for now
+  superBlock.iFormat = (iFormat == iFormatExtents && iHeight >= 5
+			? iFormatExtents : iFormatBlockMap);
+  superBlock.dFormat = (dFormat == dFormatStride
+			? dFormatStride : dFormatStream);
+  setCache(CacheBlocksDEFAULT, cachePolicyLRU);
   superBlock.nBlocksFbvBlocks =
     fbvBlocks.create(this, superBlock.nTotalBlocks, 1);
 
@@ -47,11 +62,17 @@ FileVolume::FileVolume(SimDisk * psimDisk,
 
   superBlock.nBlockBeginFiles =
       superBlock.nBlockBeginInodes + superBlock.nBlocksOfInodes;
+  if (superBlock.dFormat == dFormatStride) {
+    uint n = superBlock.nBytesPerBlock / StrideBYTES * StrideBYTES;
+    n -= superBlock.iWidth;	// at most the name length byte + name
+    superBlock.fileNameLengthMax = (n < 256 ? n : 256);
+  }
 
-  byte *bp = new byte[superBlock.nBytesPerBlock];
+  byte *bp = (byte *) alignedAlloc(superBlock.nBytesPerBlock);
+  memset(bp, 0, superBlock.nBytesPerBlock);
   memcpy(bp, &superBlock, sizeof(superBlock));
   writeBlock(0, bp);		// write it as block# 0
-  delete bp;
+  alignedFree(bp);
 
   this->root = new Directory(this, 1, 1);
 }
@@ -65,7 +86,11 @@ uint FileVolume::isOK()
     && (superBlock.nTotalBlocks ==
 	simDisk->nSectorsPerDisk / superBlock.nSecPerBlock)
     && (superBlock.nBlockBeginFiles ==
-	superBlock.nBlockBeginInodes + superBlock.nBlocksOfInodes) ;
+	superBlock.nBlockBeginInodes + superBlock.nBlocksOfInodes)
+    && (superBlock.iFormat == iFormatBlockMap
+	|| superBlock.iFormat == iFormatExtents)
+    && (superBlock.dFormat == dFormatStream
+	|| superBlock.dFormat == dFormatStride) ;
 }
 
 
@@ -75,22 +100,28 @@ uint FileVolume::isOK()
 
 FileVolume::FileVolume(uint diskNumber)
 {
+  freeRequests = 0;
+  cache = 0;
+  dentries = new DentryCache(DentryCacheSZ);
+  dirDeadBytes = 0;
+  dirIndexes = 0;
   memset(&superBlock, 0, sizeof(superBlock));
   simDisk = new SimDisk(0, diskNumber);
   if (simDisk->nSectorsPerDisk == 0)
     return;			// invalid simDisk
 
   // set this->superBlock from block/sector# 0 of simDisk
-  byte *bp = new byte[simDisk->nBytesPerSector];
+  byte *bp = (byte *) alignedAlloc(simDisk->nBytesPerSector);
   simDisk->readSector(0, bp);
   memcpy(&superBlock, bp, sizeof(superBlock));
-  delete bp;
+  alignedFree(bp);
 
   if (isOK() == 0) {
     memset(&superBlock, 0, sizeof(superBlock));
     return;
   }
 
+  setCache(CacheBlocksDEFAULT, cachePolicyLRU);
   fbvBlocks.reCreate(this, superBlock.nTotalBlocks, 1);
   fbvInodes.reCreate(this, superBlock.nInodes,
 		     1 + superBlock.nBlocksFbvBlocks);
@@ -99,6 +130,14 @@ FileVolume::FileVolume(uint diskNumber)
 
 FileVolume::~FileVolume()
 {
+  drainBlocks();
+  sync();
+  delete cache;
+  delete dentries;
+  delete [] dirDeadBytes;
+  delete [] dirIndexes;
+  for (DiskRequest * r; (r = freeRequests) != 0; delete r)
+    freeRequests = r->next;
   delete simDisk;
 }
 
@@ -109,7 +148,36 @@ File * FileVolume::findFile(byte * leafnm)
   return newf;
 }
 
-/* pre,post:: For youTODO; */
+/* post:: Read from unix file fd into buf[] until n bytes, or the end
+ * of the file.  Return the number of bytes read. */
+
+static uint readFully(int fd, byte * buf, uint n)
+{
+  uint nr = 0;
+  for (ssize_t r; nr < n && (r = read(fd, buf + nr, n - nr)) > 0;)
+    nr += r;
+  return nr;
+}
+
+/* pre:: bns[0..n-1] are block numbers, buf[] is n blocks long;; post::
+ * Queue the transfer of the k-th block of buf[] to/from block bns[k],
+ * merging runs of adjacent block numbers into one request each. */
+
+void FileVolume::queueRuns(uint * bns, uint n, byte * buf, uint writeFlag)
+{
+  uint bsz = superBlock.nBytesPerBlock;
+  for (uint i = 0, j; i < n; i = j) {
+    for (j = i + 1; j < n && bns[j] == bns[j - 1] + 1; j++)
+      ;
+    queueBlocks(bns[i], j - i, buf + i * bsz, writeFlag);
+  }
+}
+
+/* pre:: unixFilePath names a readable file;; post:: Copy it into this
+ * volume as a new file named fs33leaf, replacing any old one.  It is
+ * read AppendMAX blocks at a time, and each such piece is appended
+ * with one run of block writes and one inode update.  Return the
+ * number of bytes copied. */
 
 uint FileVolume::write33file(byte *unixFilePath, byte *fs33leaf)
 {
@@ -120,20 +188,28 @@ uint FileVolume::write33file(byte *unixFilePath, byte *fs33leaf)
 
   uint in = this->root->createFile(fs33leaf, 0);
 
-  uint bsz = superBlock.nBytesPerBlock, nBytesWritten = 0, nr;
-  File * newf = (in == 0? 0 : new File(this, in));
-  if (newf != 0) {
-    byte * buf = new byte[bsz];
-    for (; (nr = read(unixFd, buf, bsz)); nBytesWritten += nr)
-      newf->appendOneBlock(buf, nr);
-    delete buf;
-    delete newf;
+  uint bsz = superBlock.nBytesPerBlock, nBytesWritten = 0, nr, nw;
+  if (in != 0) {
+    File * f = new File(this, in);
+    byte * buf = (byte *) alignedAlloc(AppendMAX * bsz);
+    while ((nr = readFully(unixFd, buf, AppendMAX * bsz)) > 0) {
+      nw = f->appendBlocks(buf, nr);
+      nBytesWritten += nw;
+      if (nw != nr)
+	break;			// volume is full
+    }
+    alignedFree(buf);
+    delete f;
   }
   close(unixFd);
   return nBytesWritten;
 }
 
-/* pre,post:: For youTODO; */
+/* pre:: unixFilePath can be created;; post:: Copy the file named
+ * fs33leaf out of this volume into unixFilePath.  It is read
+ * AppendMAX blocks at a time, with one block map lookup and one
+ * transfer per run of adjacent blocks, and each such piece goes out
+ * with one write.  Return the number of bytes copied. */
 
 uint FileVolume::read33file(byte *fs33leaf, byte *unixFilePath)
 {
@@ -143,10 +219,14 @@ uint FileVolume::read33file(byte *fs33leaf, byte *unixFilePath)
   uint bsz = superBlock.nBytesPerBlock, nBytesWritten = 0, nr, nw, i;
   File * newf = findFile(fs33leaf);
   if (newf != 0) {
-    byte * buf = new byte[bsz];
-    for (i = 0; (nr = newf->readBlock(i++, buf)); nBytesWritten += nw)
+    byte * buf = (byte *) alignedAlloc(AppendMAX * bsz);
+    for (i = 0; (nr = newf->readBlocks(i, AppendMAX, buf)) > 0;
+	 i += AppendMAX) {
       nw = write(unixFd, buf, nr);
-    delete buf;
+      if (nw != nr) break;
+      nBytesWritten += nw;
+    }
+    alignedFree(buf);
     delete newf;
   }
   close(unixFd);
@@ -165,7 +245,8 @@ File * FileVolume::createFile(byte *pnm, uint dirFlag)
     fin = f->nInode;
   } else {
     fin = this->root->createFile(pnm, dirFlag);
-    f =  new File(this, fin);
+    if (fin > 0)
+      f =  new File(this, fin);
   }
   return f;
 }
@@ -179,19 +260,29 @@ uint FileVolume::deleteFile(byte *leafnm)
   return in;
 }
 
+/* pre:: none;; post:: Copy the file named srcleaf of this volume into
+ * a new file named dstleaf, replacing any old one.  The source is read
+ * and the copy appended AppendMAX blocks at a time.  Return the number
+ * of bytes copied. */
+
 uint FileVolume::copy33file(byte *srcleaf, byte *dstleaf)
 {
-  uint nBytesWritten = 0, nr, i;
+  uint nBytesWritten = 0, nr, nw, i;
   uint fwbsz = this->superBlock.nBytesPerBlock;
   File * fi = this->findFile(srcleaf), * fo;
   if (fi != 0 && this->inodes.getType(fi->nInode) == iTypeOrdinary) {
     this->deleteFile(dstleaf);
     fo = this->createFile(dstleaf, 0);
     if (fo != 0) {
-      byte * buf = new byte[fwbsz];
-      for (i = 0; (nr = fi->readBlock(i++, buf)); nBytesWritten += nr)
-        fo->appendBytes(buf, nr); // diff vol, so do not use appendOneBlock
-      delete buf;
+      byte * buf = (byte *) alignedAlloc(AppendMAX * fwbsz);
+      for (i = 0; (nr = fi->readBlocks(i, AppendMAX, buf)) > 0;
+	   i += AppendMAX) {
+	nw = fo->appendBytes(buf, nr); // diff vol, so do not use appendOneBlock
+	nBytesWritten += nw;
+	if (nw != nr)
+	  break;		// volume is full
+      }
+      alignedFree(buf);
       delete fo;
     }
     delete fi;
@@ -205,24 +296,48 @@ uint FileVolume::move(uint din, byte *dstleaf,
   return TODO("FileVolume::move");
 }
 
-uint FileVolume::rdwrBlock(uint nBlock, void *p, uint writeFlag)
+/* pre:: p[] is count * nBytesPerBlock long;; post:: Read/write the
+ * count adjacent blocks beginning at nBlock from/to p[], on the
+ * simDisk itself.  Their sectors are adjacent too, so this is one
+ * transfer.  Return the number of bytes transferred. */
+
+uint FileVolume::diskBlocks(uint nBlock, uint count, void *p, uint writeFlag)
 {
-  uint nbps = simDisk->nBytesPerSector;
-  uint nSecPerBlock = superBlock.nBytesPerBlock / nbps;
+  uint nSecPerBlock = superBlock.nSecPerBlock;
   uint nSector = nBlock * nSecPerBlock;
-  uint nbytes = 0;
 
-  while (nSecPerBlock > 0) {
-    nbytes += (writeFlag
-	       ? simDisk->writeSector(nSector, p)
-	       : simDisk->readSector(nSector, p));
-    p = (byte *) p + nbps;
-    nSector ++;
-    nSecPerBlock --;
-  }
+  if (count == 0 || nBlock >= superBlock.nTotalBlocks
+      || count > superBlock.nTotalBlocks - nBlock)
+    return 0;
+  return (writeFlag
+	  ? simDisk->writeSectors(nSector, count * nSecPerBlock, p)
+	  : simDisk->readSectors(nSector, count * nSecPerBlock, p));
+}
+
+/* Multi-block transfers go around the cache: a read first writes back
+ * any dirty cached copies in its range, and a write refreshes the
+ * cached copies. */
+
+uint FileVolume::rdwrBlocks(uint nBlock, uint count, void *p, uint writeFlag)
+{
+  if (cache != 0 && writeFlag == 0)
+    cache->writeBack(nBlock, count);
+  uint nbytes = diskBlocks(nBlock, count, p, writeFlag);
+  if (cache != 0 && writeFlag != 0 && nbytes > 0)
+    cache->update(nBlock, count, p, superBlock.nBytesPerBlock);
   return nbytes;
 }
 
+/* Single blocks -- superblock, bitmaps, inodes, directories -- go
+ * through the cache, if there is one. */
+
+uint FileVolume::rdwrBlock(uint nBlock, void *p, uint writeFlag)
+{
+  if (cache == 0 || nBlock >= superBlock.nTotalBlocks)
+    return diskBlocks(nBlock, 1, p, writeFlag);
+  return (writeFlag ? cache->write(nBlock, p) : cache->read(nBlock, p));
+}
+
 uint FileVolume::writeBlock(uint nBlock, void *p)
 {
   return rdwrBlock(nBlock, p, 1);
@@ -234,15 +349,134 @@ uint FileVolume::readBlock(uint nBlock, void *p)
   return rdwrBlock(nBlock, p, 0);
 }
 
+uint FileVolume::writeBlocks(uint nBlock, uint count, void *p)
+{
+  return rdwrBlocks(nBlock, count, p, 1);
+}
+
+uint FileVolume::readBlocks(uint nBlock, uint count, void *p)
+{
+  return rdwrBlocks(nBlock, count, p, 0);
+}
+
+/* pre:: p[] is one block long;; post:: Write p[] as the content of
+ * each of the count blocks beginning at nBlock, gathered into a single
+ * transfer.  Return the number of bytes written. */
+
+uint FileVolume::fillBlocks(uint nBlock, uint count, void *p)
+{
+  uint nSecPerBlock = superBlock.nSecPerBlock;
+  if (count == 0 || nBlock >= superBlock.nTotalBlocks
+      || count > superBlock.nTotalBlocks - nBlock)
+    return 0;
+
+  struct iovec * iov = new struct iovec[count];
+  for (uint i = 0; i < count; i++) {
+    iov[i].iov_base = p;
+    iov[i].iov_len = superBlock.nBytesPerBlock;
+  }
+  uint nbytes = simDisk->writeSectorsv(nBlock * nSecPerBlock, iov, count);
+  delete [] iov;
+  if (cache != 0 && nbytes > 0)
+    cache->update(nBlock, count, p, 0);
+  return nbytes;
+}
+
+/* pre:: p[] is count * nBytesPerBlock long;; post:: Start the
+ * read/write of the count adjacent blocks beginning at nBlock, on the
+ * queue of our simDisk.  p[] must be left alone until drainBlocks().
+ * Return 0 if the request is invalid. */
+
+uint FileVolume::queueBlocks(uint nBlock, uint count, void *p, uint writeFlag)
+{
+  DiskRequest * r = freeRequests;
+  if (r != 0)
+    freeRequests = r->next;
+  else
+    r = new DiskRequest;
+  uint nSecPerBlock = superBlock.nSecPerBlock;
+  uint valid = count > 0 && nBlock < superBlock.nTotalBlocks
+    && count <= superBlock.nTotalBlocks - nBlock;
+  r->nSector = nBlock * nSecPerBlock;
+  r->count = (valid ? count * nSecPerBlock : 0);
+  r->p = p;
+  r->writeFlag = writeFlag;
+  if (cache != 0 && valid)
+    (writeFlag
+     ? cache->update(nBlock, count, p, superBlock.nBytesPerBlock)
+     : (void) cache->writeBack(nBlock, count));
+  return simDisk->submit(r);
+}
+
+/* post:: Wait for all of the queueBlocks() transfers.  Return the
+ * number of bytes they moved. */
+
+uint FileVolume::drainBlocks()
+{
+  uint nbytes = 0;
+  for (DiskRequest * r; (r = simDisk->reap(1)) != 0;) {
+    nbytes += r->result;
+    r->next = freeRequests;
+    freeRequests = r;
+  }
+  return nbytes;
+}
+
+/* pre:: superBlock.nBytesPerBlock is set;; post:: Replace our block
+ * cache, writing back the old one, by one of nBlocks blocks with the
+ * given eviction policy; nBlocks == 0 means no cache.  Return
+ * nBlocks. */
+
+uint FileVolume::setCache(uint nBlocks, uint policy)
+{
+  if (cache != 0) {
+    cache->flush();
+    delete cache;
+  }
+  cache = (nBlocks > 0 ? new BlockCache(this, nBlocks, policy) : 0);
+  return nBlocks;
+}
+
+/* post:: Everything written to this volume is on the simDisk image.
+ * Return the number of blocks that had to be written back. */
+
+uint FileVolume::sync()
+{
+  uint n = inodes.sync();
+  n += fbvBlocks.sync() + fbvInodes.sync();
+  n += (cache != 0 ? cache->flush() : 0);
+  simDisk->flush();
+  return n;
+}
+
+/* post:: Forget cached inodes, blocks, directory lookups, dead
+ * space counts and index i-numbers, and re-read the in-core bitmaps,
+ * as the image may have been changed behind our back (e.g., by a
+ * child process). */
+
+void FileVolume::reload()
+{
+  inodes.discard();
+  if (cache != 0)
+    cache->discard();
+  dentries->discard();
+  delete [] dirDeadBytes;
+  dirDeadBytes = 0;
+  delete [] dirIndexes;
+  dirIndexes = 0;
+  fbvBlocks.reload();
+  fbvInodes.reload();
+}
+
 uint FileVolume::getFreeBlock()
 {
   uint bn = fbvBlocks.getFreeBit();
   if (bn > 0) {
     uint bsz = superBlock.nBytesPerBlock;
-    byte * buffer = new byte[bsz];
+    byte * buffer = (byte *) alignedAlloc(bsz);
     memset(buffer, 0, bsz);
     writeBlock(bn, buffer);
-    delete buffer;
+    alignedFree(buffer);
   }
   return bn;
 }